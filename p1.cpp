@@ -8,22 +8,48 @@
 #include <dirent.h>
 #include <cstring>
 #include <unistd.h>
+#include <sys/mman.h>
+#include <sys/resource.h>
+#include <sys/file.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/epoll.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <fcntl.h>
+#include <cerrno>
+#include <chrono>
+#if defined(__AVX2__) || defined(__SSE4_2__)
+#include <immintrin.h>
+#elif defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+#include <vector>
+#include <deque>
+#include <unordered_map>
+#include <unordered_set>
+#include <map>
+#include <list>
+#include <memory>
+#include <memory_resource>
+#include <functional>
+#include <exception>
+#include <charconv>
+#include <string_view>
+#include <type_traits>
+#include <atomic>
+#include <random>
 
 using namespace std;
 
-#define MAX_TABLES 100
-#define MAX_COLUMNS 256
-#define MAX_ROWS 1000
-
 struct parsJson {
     string name;
     int tuples_limit;
-    struct {  // Вложенная структура для таблицы и колонок
+    struct TableSchema {  // Вложенная структура для таблицы и колонок
         string table_name;
-        string columns[MAX_COLUMNS];
-        int columns_count;
-    } structure[MAX_TABLES];
-    int structure_size = 0;
+        vector<string> columns;
+    };
+    vector<TableSchema> structure;
 
     parsJson(const string& config_file) {
         ifstream file(config_file);
@@ -39,10 +65,9 @@ struct parsJson {
             } else if (line.find("\"tuples_limit\"") != string::npos) {  // Поиск лимита кортежей
                 tuples_limit = stoi(extract_value(line));  // Преобразуем строку в число и сохраняем лимит
             } else if (line.find("\"table_name\"") != string::npos) {  // Поиск имени таблицы
-                structure[structure_size].table_name = clean_string(extract_value(line));  // Извлекаем и сохраняем имя таблицы
-            } else if (line.find("\"columns\"") != string::npos) {  // Поиск колонок таблицы
-                structure[structure_size].columns_count = extract_columns(file, structure[structure_size].columns);  // Извлекаем колонки
-                structure_size++;
+                structure.push_back({clean_string(extract_value(line)), {}});  // Извлекаем и сохраняем имя таблицы
+            } else if (line.find("\"columns\"") != string::npos && !structure.empty()) {  // Поиск колонок таблицы
+                extract_columns(file, structure.back().columns);  // Извлекаем колонки
             }
         }
     }
@@ -71,13 +96,12 @@ struct parsJson {
         return value;
     }
 
-    int extract_columns(ifstream& file, string columns[]) {
-        int count = 0;
+    void extract_columns(ifstream& file, vector<string>& columns) {
         string line;
 
         if (!file.is_open()) {
             cerr << "Ошибка: Не удалось открыть файл!" << endl;
-            return count;
+            return;
         }
 
         while (getline(file, line)) {
@@ -90,681 +114,6237 @@ struct parsJson {
             }
 
             if (!line.empty()) {  // Проверяем, что строка не пустая
-                columns[count++] = line;  // Сохраняем колонку в массив
+                columns.push_back(line);  // Сохраняем колонку
             }
         }
+        columns.shrink_to_fit();  // Схема хранится весь сеанс: без запаса емкости
+    }
+};
 
-        return count;
+// Проверки условий WHERE текущим потоком; сканирование сегмента берет разность до и после
+thread_local long long predicate_evaluations = 0;
+thread_local long long predicate_matches = 0;
+
+// Счетчики одного сканирования: копятся в потоке без синхронизации и сливаются раз на сегмент
+struct ScanStats {
+    long long segments = 0;  // Открыто сегментов (CSV или колоночных копий)
+    long long cached = 0;  // Из них взято разобранными из SegmentCache
+    long long pruned = 0;  // Сегментов пропущено по карте зон
+    long long bytes = 0;  // Байт отображено для чтения
+    long long rows = 0;  // Просмотрено строк
+    long long evaluations = 0;  // Проверок условия
+    long long matched = 0;  // Строк, удовлетворивших условию
+    long long evaluations_mark = predicate_evaluations;
+    long long matches_mark = predicate_matches;
+
+    // Добавляет проверки условий, сделанные потоком с прошлого вызова (или с создания)
+    void collect_predicates() {
+        evaluations += predicate_evaluations - evaluations_mark;
+        matched += predicate_matches - matches_mark;
+        evaluations_mark = predicate_evaluations;
+        matches_mark = predicate_matches;
+    }
+};
+
+// Накопительные счетчики выполнения: по таблице за все время и по запросу под EXPLAIN ANALYZE
+struct ExecCounters {
+    atomic<long long> queries{0};
+    atomic<long long> segments{0};
+    atomic<long long> cached{0};
+    atomic<long long> pruned{0};
+    atomic<long long> bytes{0};
+    atomic<long long> rows{0};
+    atomic<long long> evaluations{0};
+    atomic<long long> matched{0};
+    atomic<long long> lock_wait_ns{0};
+
+    void add(const ScanStats& stats) {
+        segments += stats.segments;
+        cached += stats.cached;
+        pruned += stats.pruned;
+        bytes += stats.bytes;
+        rows += stats.rows;
+        evaluations += stats.evaluations;
+        matched += stats.matched;
     }
 };
 
+// Счетчики запроса, выполняемого текущим потоком; WorkerPool передает их в задачи своего задания
+thread_local ExecCounters* query_counters = nullptr;
+
+// Блокировка таблицы внутри процесса: разделяемая для SELECT, исключительная для INSERT/DELETE/CREATE INDEX.
+// Между процессами таблицу защищает flock на файле <table>_lock, который берется один раз при открытии таблицы.
 struct TableLock {
-    pthread_mutex_t lock;  // Мьютекс для синхронизации доступа к таблицам
+    pthread_rwlock_t lock;
+    int process_lock_fd = -1;
+    atomic<long long> wait_ns{0};  // Суммарное ожидание блокировки всеми потоками
 
     TableLock() {
-        pthread_mutex_init(&lock, nullptr);
+        pthread_rwlock_init(&lock, nullptr);
     }
 
+    TableLock(const TableLock&) = delete;
+    TableLock& operator=(const TableLock&) = delete;
+
     ~TableLock() {
-        pthread_mutex_destroy(&lock);
+        pthread_rwlock_destroy(&lock);
+        if (process_lock_fd >= 0) {
+            close(process_lock_fd);  // Закрытие дескриптора снимает flock
+        }
     }
 
-    void tableLock(const string& table_path) {
-        pthread_mutex_lock(&lock);  // Блокируем мьютекс
-        ofstream lock_file(table_path + "_lock");  // Открываем файл блокировки
-        lock_file << "locked";  // Записываем состояние блокировки
-        lock_file.close();  // Закрываем файл
+    // false, если таблица уже открыта другим процессом
+    bool processLock(const string& table_path) {
+        process_lock_fd = open((table_path + "_lock").c_str(), O_RDWR | O_CREAT, 0644);
+        return process_lock_fd >= 0 && flock(process_lock_fd, LOCK_EX | LOCK_NB) == 0;
     }
 
-    void tableUnlock(const string& table_path) {
-        ofstream lock_file(table_path + "_lock");
-        lock_file << "unlocked";
-        lock_file.close();
-        pthread_mutex_unlock(&lock);
+    void tableLock() {
+        if (pthread_rwlock_trywrlock(&lock) != 0) {
+            auto started = chrono::steady_clock::now();
+            pthread_rwlock_wrlock(&lock);
+            record_wait(started);
+        }
     }
-};
-
-struct Table {
-    string table_name;
-    string columns[MAX_COLUMNS];
-    int columns_count;
-    int tuples_limit;
-    string table_path;
-    TableLock table_lock;  // Объект для блокировки таблицы
-    int pk_sequence;  // Счетчик для первичного ключа
-
-    Table() : tuples_limit(0), pk_sequence(1) {}
-
-    Table(const string& name, string cols[], int columns_count, int limit, const string& schema_name)
-        : columns_count(columns_count), tuples_limit(limit), pk_sequence(1) {
-        table_name = name;
-        table_path = schema_name + "/" + table_name; // Формируем путь к файлу таблицы
-
-    mkdir(table_path.c_str(), 0777);
 
-    for (int i = 0; i < columns_count; ++i) {
-        columns[i] = cols[i];
+    void tableUnlock() {
+        pthread_rwlock_unlock(&lock);
     }
 
-    ofstream pk_file(table_path + "/" + table_name + "_pk_sequence");
-    pk_file << pk_sequence;
-    pk_file.close();
-}
-
-string get_next_file() {
-    int file_number = 1;
-    string filename;
-    while (true) {
-        filename = table_path + "/" + to_string(file_number) + ".csv";
-        ifstream file(filename);
-        if (!file) {
-            break;
+    void sharedLock() {
+        if (pthread_rwlock_tryrdlock(&lock) != 0) {
+            auto started = chrono::steady_clock::now();
+            pthread_rwlock_rdlock(&lock);
+            record_wait(started);
         }
-        if (get_row_count(filename) < tuples_limit) {
-            return filename;
-        }
-        file_number++;
     }
-    return table_path + "/" + to_string(file_number) + ".csv";
-}
 
-int get_row_count(const string& file) {
-    ifstream infile(file);
-    string line;
-    int count = 0;
-    while (getline(infile, line)) {
-        count++;
+    // Время замеряется, только если блокировку не удалось взять сразу
+    void record_wait(chrono::steady_clock::time_point started) {
+        long long waited = chrono::duration_cast<chrono::nanoseconds>(chrono::steady_clock::now() - started).count();
+        wait_ns += waited;
+        if (query_counters) {
+            query_counters->lock_wait_ns += waited;
+        }
     }
-    return count - 1;
-}
 
-void increment_pk() {
-    pk_sequence++;
-    // Записываем новое значение в файл
-    ofstream pk_file(table_path + "/" + table_name + "_pk_sequence");
-    pk_file << pk_sequence;
-    pk_file.close();
-}
-
-void insRow(string values[], int values_count) {
-    table_lock.tableLock(table_path);  // Блокируем таблицу
-
-    string current_file = get_next_file();  // Получаем имя файла для вставки
-
-    ifstream check_file(current_file);
-    bool is_empty = check_file.peek() == ifstream::traits_type::eof();  // Проверяем конец файла
-    check_file.close();
+    void sharedUnlock() {
+        pthread_rwlock_unlock(&lock);
+    }
+};
 
-    if (is_empty) {  // Если файл пустой, записываем заголовок
-        ofstream csv_out(current_file);
-        csv_out << table_name + "_pk,";  // Записываем первичный ключ
-        for (int i = 0; i < columns_count; ++i) {
-            csv_out << columns[i];  // Записываем имена колонок
-            if (i != columns_count - 1) {
-                csv_out << ",";  // Добавляем запятую, если это не последняя колонка
+// Общий пул потоков для обработки сегментов таблиц.
+// Вызывающий поток тоже берет задачи, поэтому вложенные вызовы run не блокируются.
+struct WorkerPool {
+    struct Job {
+        const function<void(int)>* task;
+        int task_count;
+        int next_task;  // Следующая нераздаленная задача
+        int done_tasks;  // Число завершенных задач
+        exception_ptr error;  // Первое исключение из задач, пробрасывается вызывающему
+        ExecCounters* counters;  // query_counters вызывающего потока
+    };
+
+    pthread_mutex_t lock;
+    pthread_cond_t wake;  // Появилась новая работа
+    pthread_cond_t finished;  // Какое-то задание завершено целиком
+    deque<Job*> jobs;
+    vector<pthread_t> threads;
+
+    WorkerPool(int thread_count) {
+        pthread_mutex_init(&lock, nullptr);
+        pthread_cond_init(&wake, nullptr);
+        pthread_cond_init(&finished, nullptr);
+        for (int i = 0; i < thread_count; ++i) {
+            pthread_t thread;
+            if (pthread_create(&thread, nullptr, worker, this) == 0) {
+                pthread_detach(thread);
+                threads.push_back(thread);
             }
         }
-        csv_out << "\n";
-        csv_out.close();
     }
 
-    // Записываем новую строку данных в файл
-    ofstream file_out(current_file, ios::app);  // Открываем файл для добавления
-    file_out << pk_sequence << ",";  // Записываем первичный ключ
-    for (int i = 0; i < values_count; ++i) {
-        file_out << values[i];  // Записываем значения колонок
-        if (i != values_count - 1) {
-            file_out << ",";  // Добавляем запятую
-        }
+    // Пул живет до конца процесса: рабочие потоки не останавливаются
+    static WorkerPool& instance() {
+        static WorkerPool* pool = new WorkerPool(max(0L, sysconf(_SC_NPROCESSORS_ONLN) - 1));
+        return *pool;
     }
-    file_out << "\n";  // Переходим на новую строку
-    file_out.close();
-
-    increment_pk();  // Увеличиваем значение первичного ключа
-    table_lock.tableUnlock(table_path);  // Разблокируем таблицу
-}
-
-void delRow(const string& condition) {
-    table_lock.tableLock(table_path);  // Блокируем таблицу
-
-    string temp_file_path = table_path + "/temp.csv";  // Временный файл для записи данных
-    string file_path = get_next_file();  // Получаем имя файла с таблицей
-    ifstream infile(file_path);  // Открываем файл для чтения
-    ofstream temp_file(temp_file_path);  // Открываем временный файл для записи
-    string line;  // Переменная для хранения строк
 
-    cout << "Удаление из таблицы: " << table_name << " с условием: '" << condition << "'" << endl;
-
-    getline(infile, line);  // Читаем заголовок таблицы
-    temp_file << line << "\n";  // Записываем заголовок во временный файл
+    // Выполняет task(0) ... task(task_count - 1) параллельно и ждет завершения всех задач
+    void run(int task_count, const function<void(int)>& task) {
+        if (task_count <= 0) {
+            return;
+        }
+        Job job{&task, task_count, 0, 0, nullptr, query_counters};
 
-    while (getline(infile, line)) {
-        cout << "Обрабатываем строку: " << line << endl;
+        pthread_mutex_lock(&lock);
+        if (task_count > 1 && !threads.empty()) {
+            jobs.push_back(&job);
+            pthread_cond_broadcast(&wake);
+        }
+        while (job.next_task < job.task_count) {
+            take_and_run(job);
+        }
+        while (job.done_tasks < job.task_count) {
+            pthread_cond_wait(&finished, &lock);
+        }
+        pthread_mutex_unlock(&lock);
 
-        if (test_where_string(line, condition)) {
-            cout << "Строка соответствует условию: " << line << endl;
-        } else {
-            cout << "Строка не соответствует условию: " << line << endl;
-            temp_file << line << "\n";
+        if (job.error) {
+            rethrow_exception(job.error);
         }
     }
 
-    infile.close();
-    temp_file.close();
-
-    remove(file_path.c_str());
-    rename(temp_file_path.c_str(), file_path.c_str());
+private:
+    // Вызывается с захваченным мьютексом, на время выполнения задачи мьютекс отпускается
+    void take_and_run(Job& job) {
+        int index = job.next_task++;
+        if (job.next_task == job.task_count) {
+            auto it = find(jobs.begin(), jobs.end(), &job);
+            if (it != jobs.end()) {
+                jobs.erase(it);  // Все задачи розданы — задание больше не нужно рабочим
+            }
+        }
+        pthread_mutex_unlock(&lock);
 
-    table_lock.tableUnlock(table_path);  // Разблокируем таблицу
-}
+        exception_ptr error;
+        ExecCounters* saved_counters = query_counters;
+        query_counters = job.counters;
+        try {
+            (*job.task)(index);
+        } catch (...) {
+            error = current_exception();
+        }
+        query_counters = saved_counters;
 
-void selectRows(const string columns[], int col_count, const string& where_clause) {
-    string file_path = get_next_file();
-    ifstream infile(file_path);
+        pthread_mutex_lock(&lock);
+        if (error && !job.error) {
+            job.error = error;
+        }
+        if (++job.done_tasks == job.task_count) {
+            pthread_cond_broadcast(&finished);
+        }
+    }
 
-    if (!infile) {
-        cerr << "Ошибка: Не удалось открыть файл " << file_path << endl;
-        return;
+    static void* worker(void* arg) {
+        WorkerPool* pool = static_cast<WorkerPool*>(arg);
+        pthread_mutex_lock(&pool->lock);
+        while (true) {
+            while (pool->jobs.empty()) {
+                pthread_cond_wait(&pool->wake, &pool->lock);
+            }
+            pool->take_and_run(*pool->jobs.front());
+        }
+        return nullptr;
     }
+};
 
-    string line;
-    bool is_first_line = true;  // Флаг для пропуска заголовка
-    bool has_output = false;  // Флаг, указывающий, были ли результаты
+// Ячейка строки CSV: указатель на байты внутри строки, без копирования
+struct FieldSpan {
+    const char* ptr;
+    size_t len;
+};
 
-    while (getline(infile, line)) {
-        if (is_first_line) {
-            is_first_line = false;  // Пропускаем заголовок
-            continue;
+// Разбиение строки на ячейки; вектор переиспользуется между строками, поэтому после первой строки аллокаций нет
+struct RowFields {
+    vector<FieldSpan> fields;
+    const char* line = nullptr;  // Вся строка без перевода строки
+    size_t line_len = 0;
+    size_t offset = 0;  // Смещение строки от начала сегмента (заполняет SegmentReader)
+
+    void split(const char* data, size_t len) {
+        fields.clear();
+        line = data;
+        line_len = len;
+        offset = 0;
+        size_t start = 0;
+        size_t i = 0;
+#if defined(__SSE2__)
+        // Ищем запятые по 16 байт за раз
+        const __m128i comma = _mm_set1_epi8(',');
+        for (; i + 16 <= len; i += 16) {
+            __m128i chunk = _mm_loadu_si128(reinterpret_cast<const __m128i*>(data + i));
+            unsigned mask = _mm_movemask_epi8(_mm_cmpeq_epi8(chunk, comma));
+            while (mask) {
+                size_t at = i + __builtin_ctz(mask);
+                fields.push_back({data + start, at - start});
+                start = at + 1;
+                mask &= mask - 1;
+            }
         }
-
-        // Проверяем, удовлетворяет ли строка условию WHERE
-        if (test_where_string(line, where_clause)) {
-            if (!has_output) {
-                cout << "Вывод выбранных колонок:" << endl;
-                has_output = true;
+#endif
+        for (; i < len; ++i) {
+            if (data[i] == ',') {
+                fields.push_back({data + start, i - start});
+                start = i + 1;
             }
-            printSelCol(line, columns, col_count);
         }
+        fields.push_back({data + start, len - start});
     }
 
-    if (!has_output) {
-        cout << "Нет данных, соответствующих условиям." << endl;
+    void split(const string& row) {
+        split(row.data(), row.size());
     }
+};
 
-    infile.close();
-}
+// Сегмент N.csv, отображенный в память только для чтения.
+// Строки разбираются на месте: ячейки указывают внутрь отображения и живут, пока жив SegmentReader.
+struct SegmentReader {
+    static constexpr char TOMBSTONE = '#';  // Первый символ строки, удаленной по первичному ключу без перезаписи сегмента
 
-int get_column_ind(const string& column_name) {
-    string table_prefix;
-    string actual_column;
+    const char* data = nullptr;
+    size_t size = 0;
+    size_t pos = 0;
 
-    // Если колонка имеет формат "table.column", разбиваем её
-    size_t dot_pos = column_name.find('.');
-    if (dot_pos != string::npos) {
-        table_prefix = column_name.substr(0, dot_pos);
-        actual_column = column_name.substr(dot_pos + 1);
-    } else {
-        actual_column = column_name;
+    SegmentReader() {}
+    SegmentReader(const SegmentReader&) = delete;
+    SegmentReader& operator=(const SegmentReader&) = delete;
+
+    ~SegmentReader() {
+        if (data) {
+            munmap(const_cast<char*>(data), size);
+        }
     }
 
-    // Проверка, является ли колонка частью данной таблицы
-    for (int i = 0; i < columns_count; ++i) {
-        if (columns[i] == actual_column) {
-            // Если префикс таблицы указан, проверяем его соответствие
-            if (!table_prefix.empty() && table_prefix != table_name) {
-                continue;  // Пропускаем, если префикс не совпадает с текущей таблицей
+    // false, если файл не удалось открыть; пустой файл открывается успешно и не содержит строк
+    bool open(const string& path) {
+        int fd = ::open(path.c_str(), O_RDONLY);
+        if (fd < 0) {
+            return false;
+        }
+        struct stat st;
+        if (fstat(fd, &st) != 0) {
+            close(fd);
+            return false;
+        }
+        size = st.st_size;
+        if (size > 0) {
+            void* mapped = mmap(nullptr, size, PROT_READ, MAP_PRIVATE, fd, 0);
+            if (mapped == MAP_FAILED) {
+                close(fd);
+                size = 0;
+                return false;
             }
-            return i + 1;  // Возвращаем индекс колонки
+            madvise(mapped, size, MADV_SEQUENTIAL);
+            data = static_cast<const char*>(mapped);
         }
+        close(fd);
+        return true;
     }
-    return -1;
-}
-
 
-bool test_where_string(const string& row, const string& where_clause) {
-
-    if (where_clause.empty()) {
+    // Следующая строка целиком (для строк, которые разбирать не нужно)
+    bool next_line(const char*& line, size_t& len) {
+        if (pos >= size) {
+            return false;
+        }
+        const char* begin = data + pos;
+        const char* end = static_cast<const char*>(memchr(begin, '\n', size - pos));
+        len = end ? end - begin : size - pos;
+        line = begin;
+        pos += len + 1;
         return true;
     }
 
-    size_t pos_eq = where_clause.find('=');
-    size_t pos_gt = where_clause.find('>');
-    size_t pos_lt = where_clause.find('<');
-
-    // Определение позиции первого найденного оператора
-    size_t pos = string::npos;
-    if (pos_eq != string::npos) pos = pos_eq;
-    if (pos_gt != string::npos && (pos == string::npos || pos_gt < pos)) pos = pos_gt;
-    if (pos_lt != string::npos && (pos == string::npos || pos_lt < pos)) pos = pos_lt;
-
-    if (pos == string::npos) {
-        cout << "Неверный формат запроса WHERE" << endl;
-        return false;
+    // Следующая строка, разобранная на ячейки за один проход по ',' и '\n'; удаленные строки пропускаются
+    bool next_row(RowFields& row) {
+        while (pos < size && data[pos] == TOMBSTONE) {
+            const char* line;
+            size_t len;
+            next_line(line, len);
+        }
+        if (pos >= size) {
+            return false;
+        }
+        row.fields.clear();
+        const char* begin = data + pos;
+        size_t start = pos;
+        size_t i = pos;
+#if defined(__SSE2__)
+        const __m128i comma = _mm_set1_epi8(',');
+        const __m128i newline = _mm_set1_epi8('\n');
+        for (; i + 16 <= size; i += 16) {
+            __m128i chunk = _mm_loadu_si128(reinterpret_cast<const __m128i*>(data + i));
+            unsigned commas = _mm_movemask_epi8(_mm_cmpeq_epi8(chunk, comma));
+            unsigned newlines = _mm_movemask_epi8(_mm_cmpeq_epi8(chunk, newline));
+            unsigned mask = commas | newlines;
+            while (mask) {
+                unsigned bit = __builtin_ctz(mask);
+                size_t at = i + bit;
+                row.fields.push_back({data + start, at - start});
+                if (newlines & (1u << bit)) {
+                    return finish_row(row, begin, at);
+                }
+                start = at + 1;
+                mask &= mask - 1;
+            }
+        }
+#endif
+        for (; i < size; ++i) {
+            if (data[i] == ',' || data[i] == '\n') {
+                row.fields.push_back({data + start, i - start});
+                if (data[i] == '\n') {
+                    return finish_row(row, begin, i);
+                }
+                start = i + 1;
+            }
+        }
+        row.fields.push_back({data + start, size - start});
+        return finish_row(row, begin, size);
     }
 
-    string column_name = where_clause.substr(0, pos);
-    string value = where_clause.substr(pos + 1);
-
-    column_name.erase(remove(column_name.begin(), column_name.end(), ' '), column_name.end());
-    value.erase(remove(value.begin(), value.end(), ' '), value.end());
-    value.erase(remove(value.begin(), value.end(), '\''), value.end());  // Удаляем кавычки
-
-    int col_index = get_column_ind(column_name);
-    cout << "Индекс для таблицы '" << column_name << "': " << col_index << endl;
-
-    if (col_index == -1) {
-        cout << "СТолбец не найден " << column_name << endl;
-        return false;
+    // Число строк данных без заголовка, включая удаленные; их число отдельно пишется в dead
+    int count_rows(int* dead = nullptr) {
+        int count = 0;
+        int tombstones = 0;
+        const char* line;
+        size_t len;
+        while (next_line(line, len)) {
+            count++;
+            tombstones += len > 0 && line[0] == TOMBSTONE;
+        }
+        if (dead) {
+            *dead = tombstones;
+        }
+        return count > 0 ? count - 1 : 0;
     }
 
-    // Разбиваем строку на отдельные ячейки
-    stringstream row_ss(row);
-    string cell;
-    int current_index = 0;
+private:
+    bool finish_row(RowFields& row, const char* begin, size_t end) {
+        row.line = begin;
+        row.line_len = data + end - begin;
+        row.offset = begin - data;
+        pos = end + 1;
+        return true;
+    }
+};
 
-    // Проходим по всем ячейкам строки
-    while (getline(row_ss, cell, ',')) {
-        // Удаляем пробелы и кавычки
-        cell.erase(remove(cell.begin(), cell.end(), ' '), cell.end());
-        cell.erase(remove(cell.begin(), cell.end(), '\"'), cell.end());
+// Разобранный сегмент в памяти: живые строки подряд и границы строк и ячеек в них.
+// Актуален, пока размер сегмента и число удаленных строк совпадают с манифестом
+struct CachedSegment {
+    long long csv_bytes = 0;
+    int dead = 0;
+    string data;  // Строки без заголовка и удаленных, каждая с '\n'
+    vector<uint32_t> row_offsets;  // Смещение строки в файле сегмента, по возрастанию
+    vector<uint32_t> row_fields;  // Ячейки строки r — field_starts[row_fields[r] .. row_fields[r + 1])
+    vector<uint32_t> field_starts;  // Начала ячеек в data
+
+    size_t rows() const {
+        return row_offsets.size();
+    }
 
-        cout << "Current cell [" << current_index << "]: '" << cell << "'" << endl;
+    size_t memory() const {
+        return sizeof(*this) + data.capacity() + (row_offsets.capacity() + row_fields.capacity() + field_starts.capacity()) * sizeof(uint32_t);
+    }
 
-        // Если индекс текущей ячейки соответствует индексу колонки
-        if (current_index == col_index) {
-            // Сравнение значения в ячейке с ожидаемым значением
-            if (pos_eq != string::npos) {
-                return cell == value;  // Сравнение на равенство
-            } else if (pos_gt != string::npos) {
-                return stoi(cell) > stoi(value);  // Сравнение на больше
-            } else if (pos_lt != string::npos) {
-                return stoi(cell) < stoi(value);  // Сравнение на меньше
+    // Разбирает сегмент, отображенный reader (после заголовка)
+    void build(SegmentReader& reader) {
+        RowFields fields;
+        data.reserve(reader.size);
+        while (reader.next_row(fields)) {
+            row_offsets.push_back(fields.offset);
+            row_fields.push_back(field_starts.size());
+            uint32_t base = data.size();
+            for (const FieldSpan& field : fields.fields) {
+                field_starts.push_back(base + (field.ptr - fields.line));
             }
+            data.append(fields.line, fields.line_len);
+            data += '\n';
         }
-        current_index++;
+        row_fields.push_back(field_starts.size());
+        data.shrink_to_fit();
+        row_offsets.shrink_to_fit();
+        field_starts.shrink_to_fit();
     }
 
-    cout << "Returning false based on matches." << endl;
-    return false;  // Условия не выполнены, возвращаем false
-}
-
-// Функция для печати выбранных колонок из строки
-void printSelCol(const string& row, const string columns[], int col_count) {
-    stringstream ss(row);  // Создаем строковый поток для строки данных
-    string cell;  // Переменная для хранения значения ячейки
-    int col_idx = 0;  // Индекс текущей колонки
-    bool is_first_row = true;  // Флаг для пропуска первичного ключа
-
-    while (getline(ss, cell, ',')) {
-        if (is_first_row) {
-            is_first_row = false;
-            col_idx++;
-            continue;
-        }
-
-        if (col_idx == 0) {
-            col_idx++;
-            continue;
+    void row(size_t r, RowFields& fields) const {
+        size_t first = row_fields[r];
+        size_t last = row_fields[r + 1];
+        size_t end = (r + 1 < rows() ? field_starts[last] : data.size()) - 1;  // Позиция '\n'
+        fields.fields.resize(last - first);
+        for (size_t k = first; k < last; ++k) {
+            size_t field_end = k + 1 < last ? field_starts[k + 1] - 1 : end;
+            fields.fields[k - first] = {data.data() + field_starts[k], field_end - field_starts[k]};
         }
+        fields.line = data.data() + field_starts[first];
+        fields.line_len = end - field_starts[first];
+        fields.offset = row_offsets[r];
+    }
 
-        // Выводим только те колонки, которые были указаны в запросе
-        if (col_idx - 1 < col_count) {
-            cout << columns[col_idx - 1] << " - " << cell << endl;
+    // Строка по смещению в файле сегмента; false, если такой живой строки нет
+    bool find_row(uint32_t offset, size_t& r) const {
+        auto it = lower_bound(row_offsets.begin(), row_offsets.end(), offset);
+        if (it == row_offsets.end() || *it != offset) {
+            return false;
         }
-        col_idx++;
+        r = it - row_offsets.begin();
+        return true;
     }
-}
 };
 
-struct Database {
-    string schema_name;
-    int tuples_limit;
-    Table tables[MAX_TABLES];
-    int tables_count = 0;
-
-    Database(const string& config_file) {
-        parsJson schema(config_file);
-
-        schema_name = schema.name;
-        tuples_limit = schema.tuples_limit;
-
-        mkdir(schema_name.c_str(), 0777);
-
-        for (int i = 0; i < schema.structure_size; ++i) {
-            // Создаем новую таблицу на основе данных из схемы и добавляем её в массив таблиц
-            Table new_table(schema.structure[i].table_name, schema.structure[i].columns, schema.structure[i].columns_count, tuples_limit, schema_name);
-            tables[tables_count++] = new_table;
-        }
+// Общий для процесса кэш разобранных сегментов с бюджетом --cache-memory и вытеснением 2Q:
+// сегмент, прочитанный впервые, попадает в очередь A1in (FIFO, четверть бюджета), вытесненный из нее
+// оставляет ключ в A1out; повторно запрошенный после этого попадает в Am (LRU). Однократный полный
+// просмотр большой таблицы проходит через A1in и не вымывает горячие сегменты из Am
+struct SegmentCache {
+    static size_t budget;  // --cache-memory, байт; 0 — кэш выключен
+    static const size_t GHOSTS = 4096;  // Ключей в A1out
+
+    struct Entry {
+        shared_ptr<const CachedSegment> segment;
+        size_t bytes;
+        bool hot;  // В Am, иначе в A1in
+        list<uint64_t>::iterator position;
+    };
+
+    pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+    unordered_map<uint64_t, Entry> entries;
+    list<uint64_t> a1in;  // Новые в начале
+    list<uint64_t> am;  // Недавно использованные в начале
+    list<uint64_t> a1out;
+    unordered_map<uint64_t, list<uint64_t>::iterator> ghosts;
+    size_t a1in_bytes = 0;
+    size_t am_bytes = 0;
+    long long hits = 0;
+    long long misses = 0;
+
+    static SegmentCache& instance() {
+        static SegmentCache* cache = new SegmentCache();
+        return *cache;
     }
 
-    Table* find_table(const string& table_name) {
-    for (int i = 0; i < tables_count; ++i) {
-        if (tables[i].table_name == table_name) {
-            return &tables[i];
-        }
+    // Ключ: номер открытой таблицы и номер сегмента
+    static uint64_t key(int table_id, int segment) {
+        return (uint64_t)table_id << 32 | (uint32_t)segment;
     }
-    cout << "Таблица не найдена: " << table_name << endl;
-    return nullptr;
-}
 
-    void insINTO(const string& table_name, string values[], int values_count) {
-        Table* table = find_table(table_name);
-        if (table) {
-            table->insRow(values, values_count);
+    // Разобранный сегмент, если он в кэше и не устарел
+    // count_miss — учитывать ли промах (точечное чтение строки сегмент в кэш не загружает)
+    shared_ptr<const CachedSegment> find(uint64_t key, long long csv_bytes, int dead, bool count_miss = true) {
+        shared_ptr<const CachedSegment> found;
+        pthread_mutex_lock(&lock);
+        auto it = entries.find(key);
+        if (it != entries.end() && (it->second.segment->csv_bytes != csv_bytes || it->second.segment->dead != dead)) {
+            remove(it);
+            it = entries.end();
+        }
+        if (it == entries.end()) {
+            misses += count_miss;
         } else {
-            cerr << "Таблица не найдена: " << table_name << endl;
+            hits++;
+            found = it->second.segment;
+            if (it->second.hot) {
+                am.splice(am.begin(), am, it->second.position);
+            }
         }
+        pthread_mutex_unlock(&lock);
+        return found;
     }
 
-    void delFROM(const string& table_name, const string& condition) {
-        Table* table = find_table(table_name);
-        if (table) {
-            table->delRow(condition);
-        } else {
-            cerr << "Таблица не найдена!" << endl;
-        }
+    // Вмещается ли сегмент такого размера в очередь A1in
+    static bool admits(long long csv_bytes) {
+        return budget > 0 && (size_t)csv_bytes * 2 < budget / 4;
     }
 
-    void selectFROM(const string& table_name, const string columns[], int col_count, const string& where_clause) {
-        Table* table = find_table(table_name);
-        if (table) {
-            table->selectRows(columns, col_count, where_clause);
+    void insert(uint64_t key, shared_ptr<const CachedSegment> segment) {
+        size_t bytes = segment->memory();
+        if (bytes > budget / 4) {
+            return;
+        }
+        pthread_mutex_lock(&lock);
+        auto old = entries.find(key);
+        if (old != entries.end()) {
+            remove(old);
+        }
+        auto ghost = ghosts.find(key);
+        bool hot = ghost != ghosts.end();  // Запрошен снова после вытеснения из A1in
+        if (hot) {
+            a1out.erase(ghost->second);
+            ghosts.erase(ghost);
+            am.push_front(key);
+            am_bytes += bytes;
         } else {
-            cerr << "Таблица не найдена!" << endl;
+            a1in.push_front(key);
+            a1in_bytes += bytes;
+        }
+        entries[key] = Entry{move(segment), bytes, hot, hot ? am.begin() : a1in.begin()};
+
+        while (a1in_bytes + am_bytes > budget) {
+            if (a1in_bytes > budget / 4 || am.empty()) {
+                uint64_t victim = a1in.back();
+                remove(entries.find(victim));
+                a1out.push_front(victim);
+                ghosts[victim] = a1out.begin();
+                if (a1out.size() > GHOSTS) {
+                    ghosts.erase(a1out.back());
+                    a1out.pop_back();
+                }
+            } else {
+                remove(entries.find(am.back()));
+            }
         }
+        pthread_mutex_unlock(&lock);
     }
 
-    void selFROMmult(const string& table_name1, const string& table_name2, const string columns[], int col_count, const string& where_clause) {
-        Table* table1 = find_table(table_name1);
-        Table* table2 = find_table(table_name2);
-
-        if (!table1) {
-            cerr << "Таблица '" << table_name1 << "' не найдена!" << endl;
-            return;
+    // Сегмент изменен: разобранная копия больше не нужна
+    void invalidate(uint64_t key) {
+        pthread_mutex_lock(&lock);
+        auto it = entries.find(key);
+        if (it != entries.end()) {
+            remove(it);
         }
+        pthread_mutex_unlock(&lock);
+    }
 
-        if (!table2) {
-            cout << "Таблица '" << table_name2 << "' не найдена. Выполняем выборку только из '" << table_name1 << "'." << endl;
-            table1->selectRows(columns, col_count, where_clause);
-            return;
-        }
+    void print_stats(ostream& out) {
+        pthread_mutex_lock(&lock);
+        out << "Кэш сегментов: " << entries.size() << " сегментов, " << (a1in_bytes + am_bytes) << " из " << budget
+            << " байт (A1in " << a1in.size() << ", Am " << am.size() << "), попаданий " << hits << ", промахов " << misses << endl;
+        pthread_mutex_unlock(&lock);
+    }
 
-        string file_path1 = table1->get_next_file();
-        string file_path2 = table2->get_next_file();
+private:
+    // Вызывается под lock
+    void remove(unordered_map<uint64_t, Entry>::iterator it) {
+        if (it->second.hot) {
+            am.erase(it->second.position);
+            am_bytes -= it->second.bytes;
+        } else {
+            a1in.erase(it->second.position);
+            a1in_bytes -= it->second.bytes;
+        }
+        entries.erase(it);
+    }
+};
 
-        ifstream infile1(file_path1);
-        ifstream infile2(file_path2);
+size_t SegmentCache::budget = 64 << 20;
 
-        string rows1[MAX_ROWS];
-        string rows2[MAX_ROWS];
-        int count1 = 0;
-        int count2 = 0;
+// Лексема SQL-запроса. Ключевые слова и имена (в том числе table.column) — WORD,
+// строки в кавычках — STRING (text без кавычек), параметры ? и $n — PARAM
+struct SqlToken {
+    enum Kind { WORD, NUMBER, STRING, PARAM, SYMBOL };
+    Kind kind;
+    pmr::string text;  // В арене запроса; копии в планах получают обычную кучу
+    int param;  // Номер параметра с нуля для PARAM, иначе -1
 
-        while (getline(infile1, rows1[count1]) && count1 < MAX_ROWS) {
-            count1++;
-        }
+    bool is(const char* word) const {
+        return kind == WORD && text == word;
+    }
 
-        while (getline(infile2, rows2[count2]) && count2 < MAX_ROWS) {
-            count2++;
-        }
+    bool is_symbol(const char* symbol) const {
+        return kind == SYMBOL && text == symbol;
+    }
+};
 
-        bool has_output = false;  // Флаг, указывающий на наличие выводимых данных
+typedef pmr::vector<SqlToken> SqlTokens;
 
-        for (int i = 1; i < count1; i++) {
-            for (int j = 1; j < count2; j++) {
-                string combined_row = rows1[i] + "," + rows2[j];  // Объединяем строки из обеих таблиц
+// Временные данные одного запроса (лексемы, значения параметров) берутся из арены на стеке
+// и освобождаются разом в конце запроса; большие запросы докупают блоки у кучи
+struct QueryArena {
+    char initial[16 * 1024];
+    pmr::monotonic_buffer_resource resource{initial, sizeof(initial)};
+};
 
-                if (table1->test_where_string(combined_row, where_clause)) {
-                    if (!has_output) {
-                        cout << "Вывод выбранных колонок из объединенных таблиц:" << endl;
-                        has_output = true;
-                    }
-                    table1->printSelCol(combined_row, columns, col_count);
-                }
+// Разбивает запрос на лексемы в памяти вектора tokens;
+// при незакрытой кавычке или неизвестном символе печатает ошибку и возвращает false
+static bool tokenize_sql(const string& query, SqlTokens& tokens) {
+    pmr::memory_resource* arena = tokens.get_allocator().resource();
+    auto push = [&](SqlToken::Kind kind, size_t pos, size_t len, int param) {
+        tokens.push_back({kind, pmr::string(query.data() + pos, len, arena), param});
+    };
+    auto word_char = [](char c) {
+        return isalnum((unsigned char)c) || c == '_' || c == '.' || (unsigned char)c >= 0x80;
+    };
+    int next_param = 0;
+    size_t pos = 0;
+    while (pos < query.size()) {
+        char c = query[pos];
+        if (c == ' ' || c == '\t' || c == '\r' || c == '\n' || c == ';') {
+            pos++;
+        } else if (c == '\'' || c == '"') {
+            size_t end = query.find(c, pos + 1);
+            if (end == string::npos) {
+                cerr << "Ошибка: незакрытая кавычка в запросе." << endl;
+                return false;
             }
+            push(SqlToken::STRING, pos + 1, end - pos - 1, -1);
+            pos = end + 1;
+        } else if (c == '?') {
+            push(SqlToken::PARAM, pos, 1, next_param++);
+            pos++;
+        } else if (c == '$' && pos + 1 < query.size() && isdigit((unsigned char)query[pos + 1])) {
+            size_t end = pos + 1;
+            while (end < query.size() && isdigit((unsigned char)query[end])) end++;
+            int index = atoi(query.c_str() + pos + 1) - 1;
+            push(SqlToken::PARAM, pos, end - pos, max(index, 0));
+            pos = end;
+        } else if (word_char(c) || ((c == '-' || c == '+') && pos + 1 < query.size() && isdigit((unsigned char)query[pos + 1]))) {
+            size_t end = pos + 1;
+            while (end < query.size() && word_char(query[end])) end++;
+            string_view text(query.data() + pos, end - pos);
+            // Число — только знак, цифры и одна точка; остальное (n4663, t.price) — имя
+            size_t digits = text[0] == '-' || text[0] == '+' ? 1 : 0;
+            bool number = digits < text.size() && text.find_first_not_of("0123456789.", digits) == string::npos &&
+                          count(text.begin(), text.end(), '.') <= 1 && text.back() != '.';
+            push(number ? SqlToken::NUMBER : SqlToken::WORD, pos, end - pos, -1);
+            pos = end;
+        } else if (strchr("(),*=", c)) {
+            push(SqlToken::SYMBOL, pos, 1, -1);
+            pos++;
+        } else if (c == '<' || c == '>' || c == '!') {
+            size_t len = pos + 1 < query.size() && query[pos + 1] == '=' ? 2 : 1;
+            if (c == '!' && len == 1) {
+                cerr << "Ошибка: неизвестный символ '!' в запросе." << endl;
+                return false;
+            }
+            push(SqlToken::SYMBOL, pos, len, -1);
+            pos += len;
+        } else {
+            cerr << "Ошибка: неизвестный символ '" << c << "' в запросе." << endl;
+            return false;
         }
-
-        if (!has_output) {
-            cout << "Нет данных, соответствующих условиям." << endl;
-        }
-
-        infile1.close();
-        infile2.close();
     }
-};
+    return true;
+}
 
-struct Node {
-    string data;
-    Node* next;
+enum CompareOp { OP_EQ, OP_NE, OP_LT, OP_GT, OP_LE, OP_GE };
 
-    Node(const string& value) : data(value), next(nullptr) {}
+// Ссылка на колонку: slot — номер таблицы в запросе (0 или 1 для соединения), index — индекс ячейки
+struct ColumnRef {
+    int slot;
+    int index;
 };
 
-struct LinkedList {
-    Node* head;
-    int size;
-
-    LinkedList() : head(nullptr), size(0) {}
+// Одно сравнение "колонка оператор значение" с заранее найденным индексом колонки и преобразованным литералом
+struct WhereCond {
+    int slot;  // Таблица, из строки которой берется ячейка
+    int col_index;  // Индекс ячейки в строке (0 — первичный ключ)
+    CompareOp op;
+    string literal;  // Значение без пробелов и кавычек
+    bool is_number;  // Литерал — целое число, для <, >, <=, >= сравниваем численно
+    long long number;
+    int rhs_slot;  // Справа колонка, а не литерал (например, a.x = b.y); -1 — литерал
+    int rhs_index;
+
+    // Пробелы и двойные кавычки в ячейке при сравнении не учитываются
+    static bool skipped(char c) {
+        return c == ' ' || c == '"';
+    }
 
-    void push_back(const string& value) {
-        Node* newNode = new Node(value);
-        if (!head) {
-            head = newNode;
-        } else {
-            Node* current = head;
-            while (current->next) {
-                current = current->next;
+    // Разбор целого из ячейки на месте; false, если ячейка не число
+    static bool parse_number(const FieldSpan& cell, long long& value) {
+        size_t i = 0;
+        while (i < cell.len && skipped(cell.ptr[i])) i++;
+        bool negative = false;
+        if (i < cell.len && (cell.ptr[i] == '-' || cell.ptr[i] == '+')) {
+            negative = cell.ptr[i] == '-';
+            i++;
+        }
+        bool digits = false;
+        value = 0;
+        for (; i < cell.len; ++i) {
+            char c = cell.ptr[i];
+            if (c >= '0' && c <= '9') {
+                value = value * 10 + (c - '0');
+                digits = true;
+            } else if (!skipped(c)) {
+                return false;
             }
-            current->next = newNode;
         }
-        size++;
+        if (negative) value = -value;
+        return digits;
     }
 
-    // Метод для доступа к элементу по индексу
-    string& get(int index) {
-        if (index < 0 || index >= size) {
-            throw out_of_range("Index out of range");
-        }
-        Node* current = head;
-        for (int i = 0; i < index; ++i) {
-            current = current->next;
+    // Лексикографическое сравнение двух ячеек без учета пропускаемых символов: <0, 0, >0
+    static int compare_text(const FieldSpan& a, const FieldSpan& b) {
+        size_t i = 0;
+        size_t j = 0;
+        while (true) {
+            while (i < a.len && skipped(a.ptr[i])) i++;
+            while (j < b.len && skipped(b.ptr[j])) j++;
+            if (i == a.len || j == b.len) {
+                return (i == a.len ? 0 : 1) - (j == b.len ? 0 : 1);
+            }
+            if (a.ptr[i] != b.ptr[j]) {
+                return (unsigned char)a.ptr[i] < (unsigned char)b.ptr[j] ? -1 : 1;
+            }
+            i++;
+            j++;
         }
-        return current->data;
     }
 
-    // Метод для печати списка (для отладки)
-    void print() const {
-        Node* current = head;
-        while (current) {
-            cout << current->data << " ";
-            current = current->next;
+    // Ключ ячейки для хеш-таблиц: содержимое без пропускаемых символов
+    static void cell_key(const FieldSpan& cell, string& key) {
+        key.clear();
+        for (size_t i = 0; i < cell.len; ++i) {
+            if (!skipped(cell.ptr[i])) key += cell.ptr[i];
         }
-        cout << endl;
     }
 
-    ~LinkedList() {
-        Node* current = head;
-        while (current) {
-            Node* nextNode = current->next;
-            delete current;
-            current = nextNode;
-        }
+    bool matches(const RowFields& row) const {
+        const RowFields* rows[1] = {&row};
+        return matches(rows);
     }
-};
 
-struct SQLParser {
-    static void execQuery(const string& query, Database& db) {
-        istringstream iss(query);  // Создаем поток для обработки SQL-запроса
-        string command;
-        iss >> command;
-
-        if (command == "INSERT") {
-            handleIns(iss, db);
-        } else if (command == "SELECT") {
-            handleSelect(iss, db);
-        } else if (command == "DELETE") {
-            handleDel(iss, db);
+    // rows[slot] — строка каждой таблицы запроса
+    bool matches(const RowFields* const* rows) const {
+        const RowFields& row = *rows[slot];
+        if (col_index >= (int)row.fields.size()) {
+            return false;
+        }
+        const FieldSpan& cell = row.fields[col_index];
+
+        int cmp;
+        long long value;
+        if (rhs_slot >= 0) {
+            const RowFields& other_row = *rows[rhs_slot];
+            if (rhs_index >= (int)other_row.fields.size()) {
+                return false;
+            }
+            const FieldSpan& other = other_row.fields[rhs_index];
+            long long other_value;
+            if (op != OP_EQ && op != OP_NE && parse_number(cell, value) && parse_number(other, other_value)) {
+                cmp = value < other_value ? -1 : (value > other_value ? 1 : 0);
+            } else {
+                cmp = compare_text(cell, other);
+            }
         } else {
-            cerr << "Неизвестная SQL-команда: " << command << endl;
+            FieldSpan literal_span{literal.data(), literal.size()};
+            if (op != OP_EQ && op != OP_NE && is_number && parse_number(cell, value)) {
+                cmp = value < number ? -1 : (value > number ? 1 : 0);
+            } else {
+                cmp = compare_text(cell, literal_span);
+            }
+        }
+        switch (op) {
+            case OP_EQ: return cmp == 0;
+            case OP_NE: return cmp != 0;
+            case OP_LT: return cmp < 0;
+            case OP_GT: return cmp > 0;
+            case OP_LE: return cmp <= 0;
+            default: return cmp >= 0;
         }
     }
+};
 
-private:
-    static void handleIns(istringstream& iss, Database& db) {
-        string into, table_name, values;
-        iss >> into >> table_name;
-
-        string row_data;
-        getline(iss, row_data);
+// Условие WHERE, разобранное один раз на запрос: OR-группы из AND-сравнений (AND связывает сильнее)
+struct WherePredicate {
+    vector<vector<WhereCond>> any_of;
+    bool valid = true;  // При ошибке разбора условию не удовлетворяет ни одна строка
 
-        size_t start = row_data.find("(");
-        size_t end = row_data.find(")");
-        if (start != string::npos && end != string::npos && end > start) {
-            row_data = row_data.substr(start + 1, end - start - 1);  // Извлекаем строку с данными
-        } else {
-            cerr << "Ошибка в синтаксисе INSERT-запроса." << endl;
-            return;
-        }
+    bool empty() const {
+        return valid && any_of.empty();
+    }
 
-        string row_values[MAX_COLUMNS];
-        int values_count = 0;
+    bool matches(const RowFields& row) const {
+        const RowFields* rows[1] = {&row};
+        return matches(rows);
+    }
 
-        stringstream ss(row_data);
-        string value;
-        while (getline(ss, value, ',')) {
-            value.erase(remove(value.begin(), value.end(), '\"'), value.end());
-            value.erase(remove(value.begin(), value.end(), ' '), value.end());
-            row_values[values_count++] = value;
+    bool matches(const RowFields* const* rows) const {
+        predicate_evaluations++;
+        if (!valid) return false;
+        if (any_of.empty()) {
+            predicate_matches++;
+            return true;
         }
-
-        db.insINTO(table_name, row_values, values_count);
-        cout << "Команда INSERT выполнена успешно" << endl;
+        for (const vector<WhereCond>& all_of : any_of) {
+            bool ok = true;
+            for (const WhereCond& cond : all_of) {
+                if (!cond.matches(rows)) {
+                    ok = false;
+                    break;
+                }
+            }
+            if (ok) {
+                predicate_matches++;
+                return true;
+            }
+        }
+        return false;
     }
 
-    static void handleDel(istringstream& iss, Database& db) {
-        string from, table_name, condition;
-        iss >> from >> table_name;
-        getline(iss, condition);
+    // Сравнение, литерал которого подставляется при выполнении подготовленного плана
+    struct ParamSlot {
+        size_t group;
+        size_t cond;
+        int param;
+    };
+
+    // Литерал сравнения: без пробелов и кавычек; целые сравниваются численно
+    static void set_literal(WhereCond& cond, string_view value) {
+        cond.literal.assign(value.data(), value.size());
+        FieldSpan literal_span{cond.literal.data(), cond.literal.size()};
+        cond.is_number = WhereCond::parse_number(literal_span, cond.number);
+    }
 
-        if (!condition.empty() && condition.find("WHERE") != string::npos) {
-            condition = condition.substr(condition.find("WHERE") + 6);
-        } else {
-            condition.clear();
+    // Копия условия с подставленными значениями параметров
+    WherePredicate bind(const vector<ParamSlot>& slots, const pmr::vector<string_view>& params) const {
+        WherePredicate bound = *this;
+        for (const ParamSlot& slot : slots) {
+            set_literal(bound.any_of[slot.group][slot.cond], params[slot.param]);
         }
-
-        db.delFROM(table_name, condition);  // Удаляем строки, соответствующие условию
-        cout << "Команда DELETE выполнена успешно" << endl;
+        return bound;
     }
 
-    static void handleSelect(istringstream& iss, Database& db) {
-        string select_part, from_part, where_clause;
-        string query = iss.str();
+    // Разбирает лексемы условия WHERE [begin, end): сравнения "колонка оператор значение", связанные AND и OR.
+    // resolve_column возвращает ссылку на колонку по имени (index == -1, если колонка не найдена);
+    // сравнения с параметрами попадают в slots. При ошибке печатает сообщение и возвращает valid == false.
+    static WherePredicate compile(const SqlTokens& tokens, size_t begin, size_t end,
+                                  const function<ColumnRef(const string&)>& resolve_column, vector<ParamSlot>& slots) {
+        WherePredicate predicate;
+        vector<WhereCond> all_of;
+        size_t pos = begin;
+        while (true) {
+            if (pos + 3 > end || tokens[pos].kind != SqlToken::WORD || tokens[pos + 1].kind != SqlToken::SYMBOL) {
+                cerr << "Неверный формат запроса WHERE" << endl;
+                predicate.valid = false;
+                return predicate;
+            }
+            string column_name(tokens[pos].text);
+            const pmr::string& op = tokens[pos + 1].text;
+            const SqlToken& value = tokens[pos + 2];
+            WhereCond cond{0, -1, OP_EQ, "", false, 0, -1, -1};
+            if (op == "!=") cond.op = OP_NE;
+            else if (op == "<") cond.op = OP_LT;
+            else if (op == ">") cond.op = OP_GT;
+            else if (op == "<=") cond.op = OP_LE;
+            else if (op == ">=") cond.op = OP_GE;
+            else if (op != "=" || value.kind == SqlToken::SYMBOL) {
+                cerr << "Неверный формат запроса WHERE" << endl;
+                predicate.valid = false;
+                return predicate;
+            }
 
-        // Ищем ключевые слова в строке запроса
-        size_t from_pos = query.find("FROM");
-        size_t where_pos = query.find("WHERE");
+            ColumnRef column = resolve_column(column_name);
+            if (column.index == -1) {
+                cerr << "Столбец не найден " << column_name << endl;
+                predicate.valid = false;
+                return predicate;
+            }
+            cond.slot = column.slot;
+            cond.col_index = column.index;
 
-        if (from_pos == string::npos) {
-            cerr << "Ошибка: Ключевое слово FROM не найдено в запросе." << endl;
-            return;
+            // Значение без кавычек вида table.column сравнивается с другой колонкой
+            ColumnRef other{0, -1};
+            if (value.kind == SqlToken::WORD && value.text.find('.') != string::npos) {
+                other = resolve_column(string(value.text));
+            }
+            if (other.index != -1) {
+                cond.rhs_slot = other.slot;
+                cond.rhs_index = other.index;
+            } else if (value.kind == SqlToken::PARAM) {
+                slots.push_back({predicate.any_of.size(), all_of.size(), value.param});
+            } else {
+                set_literal(cond, value.text);
+            }
+            all_of.push_back(cond);
+            pos += 3;
+
+            if (pos == end || tokens[pos].is("OR")) {
+                predicate.any_of.push_back(all_of);
+                all_of.clear();
+            } else if (!tokens[pos].is("AND")) {
+                cerr << "Неверный формат запроса WHERE" << endl;
+                predicate.valid = false;
+                return predicate;
+            }
+            if (pos == end) {
+                return predicate;
+            }
+            pos++;
         }
+    }
+};
 
-        select_part = query.substr(0, from_pos);
-        if (where_pos != string::npos) {
-            from_part = query.substr(from_pos + 5, where_pos - from_pos - 5);
-            where_clause = query.substr(where_pos + 6);
+// Функция элемента списка SELECT с агрегатами
+enum AggregateFunc {
+    AGG_GROUP,  // Колонка из GROUP BY, выводится значение группы
+    AGG_COUNT,
+    AGG_SUM,
+    AGG_MIN,
+    AGG_MAX,
+    AGG_AVG
+};
+
+// Элемент агрегирующего SELECT: колонка GROUP BY или функция от колонки (col_index == -1 — COUNT(*))
+struct AggregateItem {
+    AggregateFunc func;
+    int col_index;
+    int group_pos;  // Для AGG_GROUP — номер колонки в GROUP BY
+    string label;
+};
+
+// Частичный агрегат одной функции в одной группе. Пустые и (для SUM/AVG) нечисловые ячейки не учитываются.
+// MIN/MAX сравнивают численно, пока все ячейки — числа, иначе как текст через compare_text.
+struct AggregateState {
+    long long count = 0;  // Строк для COUNT(*), иначе учтенных непустых ячеек
+    long long numbers = 0;  // Числовых ячеек
+    long long int_sum = 0;
+    double sum = 0;
+    bool all_int = true;  // Все числа целые: SUM печатается без дробной части
+    bool numeric = true;  // Все ячейки MIN/MAX — числа
+    double min_number = 0;
+    double max_number = 0;
+    string min_number_text, max_number_text;  // Исходный текст численных минимума и максимума
+    string min_text, max_text;
+
+    static bool is_empty(const FieldSpan& cell) {
+        for (size_t i = 0; i < cell.len; ++i) {
+            if (!WhereCond::skipped(cell.ptr[i])) {
+                return false;
+            }
+        }
+        return true;
+    }
+
+    static bool cell_number(const FieldSpan& cell, double& value, bool& is_int, long long& integer, string& scratch) {
+        if (WhereCond::parse_number(cell, integer)) {
+            is_int = true;
+            value = integer;
+            return true;
+        }
+        WhereCond::cell_key(cell, scratch);
+        const char* end = scratch.data() + scratch.size();
+        auto parsed = from_chars(scratch.data(), end, value);
+        is_int = false;
+        return parsed.ec == errc() && parsed.ptr == end && !scratch.empty();
+    }
+
+    void add(AggregateFunc func, const FieldSpan* cell, string& scratch) {
+        if (!cell) {
+            count++;  // COUNT(*)
+            return;
+        }
+        if (is_empty(*cell)) {
+            return;
+        }
+        count++;
+        if (func == AGG_COUNT) {
+            return;
+        }
+
+        double value;
+        bool is_int;
+        long long integer;
+        bool number = cell_number(*cell, value, is_int, integer, scratch);
+        if (func == AGG_SUM || func == AGG_AVG) {
+            if (number) {
+                numbers++;
+                sum += value;
+                int_sum += is_int ? integer : 0;
+                all_int = all_int && is_int;
+            }
+            return;
+        }
+
+        bool first = count == 1;
+        if (number) {
+            if (numbers++ == 0 || value < min_number) {
+                min_number = value;
+                min_number_text.assign(cell->ptr, cell->len);
+            }
+            if (numbers == 1 || value > max_number) {
+                max_number = value;
+                max_number_text.assign(cell->ptr, cell->len);
+            }
+        } else {
+            numeric = false;
+        }
+        FieldSpan min{min_text.data(), min_text.size()};
+        FieldSpan max{max_text.data(), max_text.size()};
+        if (first || WhereCond::compare_text(*cell, min) < 0) {
+            min_text.assign(cell->ptr, cell->len);
+        }
+        if (first || WhereCond::compare_text(*cell, max) > 0) {
+            max_text.assign(cell->ptr, cell->len);
+        }
+    }
+
+    void merge(const AggregateState& other) {
+        if (other.count == 0) {
+            return;
+        }
+        if (other.numbers > 0) {
+            if (numbers == 0 || other.min_number < min_number) {
+                min_number = other.min_number;
+                min_number_text = other.min_number_text;
+            }
+            if (numbers == 0 || other.max_number > max_number) {
+                max_number = other.max_number;
+                max_number_text = other.max_number_text;
+            }
+        }
+        FieldSpan other_min{other.min_text.data(), other.min_text.size()};
+        FieldSpan other_max{other.max_text.data(), other.max_text.size()};
+        if (count == 0 || WhereCond::compare_text(other_min, FieldSpan{min_text.data(), min_text.size()}) < 0) {
+            min_text = other.min_text;
+        }
+        if (count == 0 || WhereCond::compare_text(other_max, FieldSpan{max_text.data(), max_text.size()}) > 0) {
+            max_text = other.max_text;
+        }
+        count += other.count;
+        numbers += other.numbers;
+        int_sum += other.int_sum;
+        sum += other.sum;
+        all_int = all_int && other.all_int;
+        numeric = numeric && other.numeric;
+    }
+
+    static string format_double(double value) {
+        char buffer[32];
+        auto printed = to_chars(buffer, buffer + sizeof(buffer), value);
+        return string(buffer, printed.ptr - buffer);
+    }
+
+    string result(AggregateFunc func) const {
+        switch (func) {
+            case AGG_COUNT: return to_string(count);
+            case AGG_SUM: return numbers == 0 ? "NULL" : (all_int ? to_string(int_sum) : format_double(sum));
+            case AGG_AVG: return numbers == 0 ? "NULL" : format_double(sum / numbers);
+            case AGG_MIN: return count == 0 ? "NULL" : (numeric ? min_number_text : min_text);
+            case AGG_MAX: return count == 0 ? "NULL" : (numeric ? max_number_text : max_text);
+            default: return "";
+        }
+    }
+};
+
+// Запись вторичного индекса: сегмент и первичный ключ строки
+struct IndexEntry {
+    int segment;
+    int pk;
+};
+
+// Ключ упорядоченного индекса: числа упорядочены по значению и идут раньше остальных строк
+struct OrderedKey {
+    bool is_number;
+    long long number;
+    string text;
+
+    explicit OrderedKey(const string& key) : number(0), text(key) {
+        FieldSpan span{text.data(), text.size()};
+        is_number = WhereCond::parse_number(span, number);
+    }
+
+    bool operator<(const OrderedKey& other) const {
+        if (is_number != other.is_number) {
+            return is_number;
+        }
+        return is_number ? number < other.number : text < other.text;
+    }
+};
+
+// Вторичный индекс по колонке: хеш для равенства или упорядоченное дерево для равенства и диапазонов.
+// Файл <колонка>.idx: заголовок "hash|ordered <колонка>", затем строки "сегмент,pk,значение".
+struct ColumnIndex {
+    string column;
+    int col_index = -1;  // Индекс ячейки в строке таблицы
+    bool ordered = false;
+    unordered_map<string, vector<IndexEntry>> hash;
+    map<OrderedKey, vector<IndexEntry>> tree;
+
+    void add(const string& key, IndexEntry entry) {
+        if (ordered) {
+            tree[OrderedKey(key)].push_back(entry);
+        } else {
+            hash[key].push_back(entry);
+        }
+    }
+
+    void remove_entry(const string& key, int pk) {
+        vector<IndexEntry>* entries = nullptr;
+        if (ordered) {
+            auto it = tree.find(OrderedKey(key));
+            if (it != tree.end()) entries = &it->second;
+        } else {
+            auto it = hash.find(key);
+            if (it != hash.end()) entries = &it->second;
+        }
+        if (!entries) {
+            return;
+        }
+        for (size_t i = 0; i < entries->size(); ++i) {
+            if ((*entries)[i].pk == pk) {
+                (*entries)[i] = entries->back();
+                entries->pop_back();
+                break;
+            }
+        }
+        if (entries->empty()) {
+            if (ordered) tree.erase(OrderedKey(key));
+            else hash.erase(key);
+        }
+    }
+
+    // Отмечает в marked сегменты, где могут быть строки для сравнения; false, если индекс здесь не помогает.
+    // Результат — надмножество: строки все равно перепроверяются полным условием при чтении сегмента.
+    bool lookup(const WhereCond& cond, vector<char>& marked) const {
+        if (cond.col_index != col_index || cond.rhs_slot >= 0 || cond.op == OP_NE) {
+            return false;
+        }
+        if (cond.op == OP_EQ) {
+            if (ordered) {
+                auto it = tree.find(OrderedKey(cond.literal));
+                if (it != tree.end()) mark(it->second, marked);
+            } else {
+                auto it = hash.find(cond.literal);
+                if (it != hash.end()) mark(it->second, marked);
+            }
+            return true;
+        }
+        if (!ordered || !cond.is_number) {
+            return false;
+        }
+
+        OrderedKey key(cond.literal);
+        auto first_text = tree.lower_bound(OrderedKey(""));  // Нечисловые значения сравниваются как текст — берем их все
+        auto from = tree.begin();
+        auto to = tree.end();
+        switch (cond.op) {
+            case OP_GT: from = tree.upper_bound(key); break;
+            case OP_GE: from = tree.lower_bound(key); break;
+            case OP_LT: to = tree.lower_bound(key); break;
+            default: to = tree.upper_bound(key); break;
+        }
+        for (auto it = from; it != to; ++it) {
+            mark(it->second, marked);
+        }
+        if (cond.op == OP_LT || cond.op == OP_LE) {
+            for (auto it = first_text; it != tree.end(); ++it) {
+                mark(it->second, marked);
+            }
+        }
+        return true;
+    }
+
+    static void mark(const vector<IndexEntry>& entries, vector<char>& marked) {
+        for (const IndexEntry& entry : entries) {
+            if (entry.segment >= 1 && entry.segment <= (int)marked.size()) {
+                marked[entry.segment - 1] = 1;
+            }
+        }
+    }
+
+    // Первичные ключи строк, у которых ячейка равна литералу; false, если это не равенство по этой колонке
+    bool lookup_pks(const WhereCond& cond, vector<int>& pks) const {
+        if (cond.col_index != col_index || cond.rhs_slot >= 0 || cond.op != OP_EQ) {
+            return false;
+        }
+        const vector<IndexEntry>* entries = nullptr;
+        if (ordered) {
+            auto it = tree.find(OrderedKey(cond.literal));
+            if (it != tree.end()) entries = &it->second;
+        } else {
+            auto it = hash.find(cond.literal);
+            if (it != hash.end()) entries = &it->second;
+        }
+        if (entries) {
+            for (const IndexEntry& entry : *entries) {
+                pks.push_back(entry.pk);
+            }
+        }
+        return true;
+    }
+
+    // Строка удаления записи: дописывается в файл индекса вместо его перезаписи
+    static void append_removal(string& out, const string& key, IndexEntry entry) {
+        out += "-";
+        append_line(out, key, entry);
+    }
+
+    static void append_line(string& out, const string& key, IndexEntry entry) {
+        out += to_string(entry.segment);
+        out += ",";
+        out += to_string(entry.pk);
+        out += ",";
+        out += key;
+        out += "\n";
+    }
+
+    string header_line() const {
+        return string(ordered ? "ordered " : "hash ") + column + "\n";
+    }
+
+    // Полная перезапись файла индекса через временный файл
+    void save(const string& path) const {
+        string out = header_line();
+        if (ordered) {
+            for (const auto& item : tree) {
+                for (const IndexEntry& entry : item.second) append_line(out, item.first.text, entry);
+            }
+        } else {
+            for (const auto& item : hash) {
+                for (const IndexEntry& entry : item.second) append_line(out, item.first, entry);
+            }
+        }
+        string temp_path = path + ".tmp";
+        ofstream file(temp_path);
+        file << out;
+        file.close();
+        rename(temp_path.c_str(), path.c_str());
+    }
+
+    // removals — число строк удаления в файле; когда их много, файл стоит переписать заново
+    bool load(const string& path, int& removals) {
+        ifstream file(path);
+        string kind;
+        removals = 0;
+        if (!(file >> kind >> column) || (kind != "hash" && kind != "ordered")) {
+            return false;
+        }
+        ordered = kind == "ordered";
+        string line;
+        getline(file, line);
+        while (getline(file, line)) {
+            bool removal = !line.empty() && line[0] == '-';
+            size_t begin = removal ? 1 : 0;
+            size_t first = line.find(',', begin);
+            size_t second = first == string::npos ? string::npos : line.find(',', first + 1);
+            if (second == string::npos) {
+                return false;
+            }
+            IndexEntry entry{atoi(line.c_str() + begin), atoi(line.c_str() + first + 1)};
+            if (removal) {
+                remove_entry(line.substr(second + 1), entry.pk);
+                removals++;
+            } else {
+                add(line.substr(second + 1), entry);
+            }
+        }
+        return true;
+    }
+};
+
+// Положение строки для индекса первичного ключа; segment == 0 — строки с таким ключом нет
+struct RowLocation {
+    int segment;
+    unsigned offset;
+};
+
+// Колоночная копия запечатанного сегмента N.csv — файл N.col для таблиц в режиме STORAGE COLUMNAR.
+// CSV остается основным форматом: .col строится по нему и используется, только пока размер CSV и число
+// удаленных строк совпадают с записанными в заголовке. Строки делятся на блоки по CHUNK_ROWS; у каждой колонки
+// блока свой тип (int64, double или словарь строк) и min/max, по которым блок пропускается целиком.
+// Числовой тип выбирается, только если текст ячеек восстанавливается из числа байт в байт.
+struct ColumnarSegment {
+    enum ColumnType : uint8_t {
+        COL_INT64,
+        COL_DOUBLE,
+        COL_STRING  // Словарь, отсортированный по compare_text (таблица смещений и байты), и 32-битные коды строк
+    };
+
+    static const int CHUNK_ROWS = 4096;
+    static constexpr char MAGIC[8] = {'P', '1', 'C', 'O', 'L', '0', '0', '2'};
+    static const size_t HEADER_SIZE = 8 + 8 + 4 * 4;
+
+    // Заголовок: сигнатура, размер CSV и число удаленных строк на момент построения, строк, колонок, блоков
+    long long csv_bytes = -1;
+    int dead = 0;
+    int rows = 0;
+    int columns = 0;
+    int chunks = 0;
+
+    char* map = nullptr;
+    size_t map_size = 0;
+
+    // Колонка блока после разбора: значения остаются в отображении файла
+    struct Block {
+        ColumnType type;
+        const char* values;  // int64/double значения или коды словаря
+        long long min_int, max_int;
+        double min_double, max_double;
+        uint32_t dict_size;
+        const char* dict_offsets;  // dict_size + 1 смещений от dict_bytes
+        const char* dict_bytes;
+
+        FieldSpan entry(uint32_t d) const {
+            uint32_t begin = load<uint32_t>(dict_offsets + 4 * d);
+            return {dict_bytes + begin, load<uint32_t>(dict_offsets + 4 * d + 4) - begin};
+        }
+    };
+
+    ColumnarSegment() = default;
+    ColumnarSegment(const ColumnarSegment&) = delete;
+    ColumnarSegment& operator=(const ColumnarSegment&) = delete;
+
+    ~ColumnarSegment() {
+        if (map) {
+            munmap(map, map_size);
+        }
+    }
+
+    template <class T>
+    static T load(const char* p) {
+        T value;
+        memcpy(&value, p, sizeof(T));
+        return value;
+    }
+
+    template <class T>
+    static void put(string& out, T value) {
+        out.append(reinterpret_cast<const char*>(&value), sizeof(T));
+    }
+
+    static bool parse_header(const char* data, size_t size, ColumnarSegment& segment) {
+        if (size < HEADER_SIZE || memcmp(data, MAGIC, 8) != 0) {
+            return false;
+        }
+        segment.csv_bytes = load<long long>(data + 8);
+        segment.dead = load<int>(data + 16);
+        segment.rows = load<int>(data + 20);
+        segment.columns = load<int>(data + 24);
+        segment.chunks = load<int>(data + 28);
+        return true;
+    }
+
+    // Только заголовок: достаточно, чтобы проверить актуальность копии
+    bool read_header(const string& path) {
+        int fd = open(path.c_str(), O_RDONLY);
+        if (fd < 0) {
+            return false;
+        }
+        char header[HEADER_SIZE];
+        bool ok = pread(fd, header, HEADER_SIZE, 0) == (ssize_t)HEADER_SIZE && parse_header(header, HEADER_SIZE, *this);
+        close(fd);
+        return ok;
+    }
+
+    bool open_map(const string& path) {
+        int fd = open(path.c_str(), O_RDONLY);
+        if (fd < 0) {
+            return false;
+        }
+        struct stat st;
+        if (fstat(fd, &st) != 0 || st.st_size < (off_t)HEADER_SIZE) {
+            close(fd);
+            return false;
+        }
+        map_size = st.st_size;
+        void* data = mmap(nullptr, map_size, PROT_READ, MAP_PRIVATE, fd, 0);
+        close(fd);
+        if (data == MAP_FAILED) {
+            map = nullptr;
+            return false;
+        }
+        map = static_cast<char*>(data);
+        return parse_header(map, map_size, *this);
+    }
+
+    static bool as_int(const FieldSpan& cell, long long& value) {
+        auto parsed = from_chars(cell.ptr, cell.ptr + cell.len, value);
+        if (parsed.ec != errc() || parsed.ptr != cell.ptr + cell.len || cell.len == 0) {
+            return false;
+        }
+        char buffer[24];
+        auto printed = to_chars(buffer, buffer + sizeof(buffer), value);
+        return (size_t)(printed.ptr - buffer) == cell.len && memcmp(buffer, cell.ptr, cell.len) == 0;
+    }
+
+    static bool as_double(const FieldSpan& cell, double& value) {
+        auto parsed = from_chars(cell.ptr, cell.ptr + cell.len, value);
+        if (parsed.ec != errc() || parsed.ptr != cell.ptr + cell.len || cell.len == 0 || value != value ||
+            value - value != 0) {
+            return false;  // Не число, NaN или бесконечность
+        }
+        char buffer[32];
+        auto printed = to_chars(buffer, buffer + sizeof(buffer), value);
+        return (size_t)(printed.ptr - buffer) == cell.len && memcmp(buffer, cell.ptr, cell.len) == 0;
+    }
+
+    static bool text_less(const FieldSpan& a, const FieldSpan& b) {
+        int cmp = WhereCond::compare_text(a, b);
+        if (cmp != 0) {
+            return cmp < 0;
+        }
+        return string_view(a.ptr, a.len) < string_view(b.ptr, b.len);
+    }
+
+    // Блок колонки: размер блока, тип, min/max и значения
+    static void encode_column(const vector<FieldSpan>& cells, string& out) {
+        size_t size_at = out.size();
+        put<long long>(out, 0);
+
+        vector<long long> ints(cells.size());
+        bool is_int = true;
+        for (size_t r = 0; r < cells.size() && is_int; ++r) {
+            is_int = as_int(cells[r], ints[r]);
+        }
+        vector<double> doubles;
+        bool is_double = false;
+        if (!is_int) {
+            doubles.resize(cells.size());
+            is_double = true;
+            for (size_t r = 0; r < cells.size() && is_double; ++r) {
+                is_double = as_double(cells[r], doubles[r]);
+            }
+        }
+
+        if (is_int) {
+            put<uint8_t>(out, COL_INT64);
+            put<long long>(out, *min_element(ints.begin(), ints.end()));
+            put<long long>(out, *max_element(ints.begin(), ints.end()));
+            out.append(reinterpret_cast<const char*>(ints.data()), ints.size() * sizeof(long long));
+        } else if (is_double) {
+            put<uint8_t>(out, COL_DOUBLE);
+            put<double>(out, *min_element(doubles.begin(), doubles.end()));
+            put<double>(out, *max_element(doubles.begin(), doubles.end()));
+            out.append(reinterpret_cast<const char*>(doubles.data()), doubles.size() * sizeof(double));
+        } else {
+            vector<FieldSpan> dict(cells);
+            sort(dict.begin(), dict.end(), text_less);
+            dict.erase(unique(dict.begin(), dict.end(), [](const FieldSpan& a, const FieldSpan& b) {
+                return string_view(a.ptr, a.len) == string_view(b.ptr, b.len);
+            }), dict.end());
+            unordered_map<string_view, uint32_t> codes;
+            put<uint8_t>(out, COL_STRING);
+            put<uint32_t>(out, dict.size());
+            uint32_t offset = 0;
+            for (size_t d = 0; d < dict.size(); ++d) {
+                codes[string_view(dict[d].ptr, dict[d].len)] = d;
+                put<uint32_t>(out, offset);
+                offset += dict[d].len;
+            }
+            put<uint32_t>(out, offset);
+            for (const FieldSpan& value : dict) {
+                out.append(value.ptr, value.len);
+            }
+            for (const FieldSpan& cell : cells) {
+                put<uint32_t>(out, codes[string_view(cell.ptr, cell.len)]);
+            }
+        }
+        long long block_size = out.size() - size_at - sizeof(long long);
+        memcpy(&out[size_at], &block_size, sizeof(block_size));
+    }
+
+    // Строит .col по CSV-сегменту; false, если в сегменте есть строки с другим числом ячеек
+    static bool build(const string& csv_path, const string& col_path, long long csv_bytes, int dead, int column_count) {
+        SegmentReader reader;
+        if (!reader.open(csv_path)) {
+            return false;
+        }
+        const char* header;
+        size_t header_len;
+        reader.next_line(header, header_len);  // Заголовок в .col не переносится
+
+        string body;
+        int total_rows = 0;
+        int chunk_count = 0;
+        vector<vector<FieldSpan>> cells(column_count);
+        RowFields fields;
+        bool more = true;
+        while (more) {
+            for (vector<FieldSpan>& column : cells) {
+                column.clear();
+            }
+            int chunk_rows = 0;
+            while (chunk_rows < CHUNK_ROWS && (more = reader.next_row(fields))) {
+                if ((int)fields.fields.size() != column_count) {
+                    return false;
+                }
+                for (int c = 0; c < column_count; ++c) {
+                    cells[c].push_back(fields.fields[c]);
+                }
+                chunk_rows++;
+            }
+            if (chunk_rows == 0) {
+                break;
+            }
+            put<int>(body, chunk_rows);
+            for (int c = 0; c < column_count; ++c) {
+                encode_column(cells[c], body);
+            }
+            total_rows += chunk_rows;
+            chunk_count++;
+        }
+
+        string out(MAGIC, 8);
+        put<long long>(out, csv_bytes);
+        put<int>(out, dead);
+        put<int>(out, total_rows);
+        put<int>(out, column_count);
+        put<int>(out, chunk_count);
+        out += body;
+
+        string temp_path = col_path + ".tmp";
+        ofstream file(temp_path, ios::binary | ios::trunc);
+        file.write(out.data(), out.size());
+        file.close();
+        if (!file) {
+            unlink(temp_path.c_str());
+            return false;
+        }
+        return rename(temp_path.c_str(), col_path.c_str()) == 0;
+    }
+
+    static Block decode(const char* p) {
+        Block block;
+        block.type = (ColumnType)load<uint8_t>(p);
+        p += 1;
+        if (block.type == COL_INT64) {
+            block.min_int = load<long long>(p);
+            block.max_int = load<long long>(p + 8);
+            block.values = p + 16;
+        } else if (block.type == COL_DOUBLE) {
+            block.min_double = load<double>(p);
+            block.max_double = load<double>(p + 8);
+            block.values = p + 16;
+        } else {
+            block.dict_size = load<uint32_t>(p);
+            block.dict_offsets = p + 4;
+            block.dict_bytes = block.dict_offsets + 4 * (block.dict_size + 1);
+            block.values = block.dict_bytes + load<uint32_t>(block.dict_offsets + 4 * block.dict_size);
+        }
+        return block;
+    }
+
+    // true, если ни одна строка блока заведомо не удовлетворяет сравнению
+    static bool excludes(const Block& block, const WhereCond& cond) {
+        FieldSpan literal{cond.literal.data(), cond.literal.size()};
+        bool ordered = cond.op != OP_EQ && cond.op != OP_NE;
+        if (block.type == COL_INT64) {
+            long long value;
+            if (cond.op == OP_EQ) {
+                // Равенство текстовое, а ячейки блока — канонические записи целых
+                return !as_int(literal, value) || value < block.min_int || value > block.max_int;
+            }
+            if (!ordered || !cond.is_number) {
+                return false;
+            }
+            switch (cond.op) {
+                case OP_LT: return block.min_int >= cond.number;
+                case OP_LE: return block.min_int > cond.number;
+                case OP_GT: return block.max_int <= cond.number;
+                default: return block.max_int < cond.number;
+            }
+        }
+        if (block.type == COL_DOUBLE) {
+            double value;
+            return cond.op == OP_EQ && (!as_double(literal, value) || value < block.min_double || value > block.max_double);
+        }
+        if (block.dict_size == 0) {
+            return true;
+        }
+        FieldSpan min = block.entry(0);
+        FieldSpan max = block.entry(block.dict_size - 1);
+        if (cond.op == OP_EQ) {
+            return WhereCond::compare_text(literal, min) < 0 || WhereCond::compare_text(literal, max) > 0;
+        }
+        if (!ordered || cond.is_number) {
+            return false;  // Числовые ячейки сравниваются с числом численно, порядок словаря не помогает
+        }
+        switch (cond.op) {
+            case OP_LT: return WhereCond::compare_text(min, literal) >= 0;
+            case OP_LE: return WhereCond::compare_text(min, literal) > 0;
+            case OP_GT: return WhereCond::compare_text(max, literal) <= 0;
+            default: return WhereCond::compare_text(max, literal) < 0;
+        }
+    }
+
+    // Ядро сравнения блока целых с константой: sel[r] = 1, если values[r] op value.
+    // Сравнение идет по 4 (AVX2) или 2 (SSE4.2) значения за раз, хвост и остальные сборки — по одному.
+    static void compare_ints(const char* values, int count, CompareOp op, long long value, uint8_t* sel) {
+        int r = 0;
+#if defined(__AVX2__)
+        const __m256i constant = _mm256_set1_epi64x(value);
+        for (; r + 4 <= count; r += 4) {
+            __m256i chunk = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(values + 8 * r));
+            __m256i mask;
+            switch (op) {
+                case OP_EQ: mask = _mm256_cmpeq_epi64(chunk, constant); break;
+                case OP_NE: mask = _mm256_xor_si256(_mm256_cmpeq_epi64(chunk, constant), _mm256_set1_epi64x(-1)); break;
+                case OP_LT: mask = _mm256_cmpgt_epi64(constant, chunk); break;
+                case OP_GT: mask = _mm256_cmpgt_epi64(chunk, constant); break;
+                case OP_LE: mask = _mm256_xor_si256(_mm256_cmpgt_epi64(chunk, constant), _mm256_set1_epi64x(-1)); break;
+                default: mask = _mm256_xor_si256(_mm256_cmpgt_epi64(constant, chunk), _mm256_set1_epi64x(-1)); break;
+            }
+            int bits = _mm256_movemask_pd(_mm256_castsi256_pd(mask));
+            for (int k = 0; k < 4; ++k) {
+                sel[r + k] = (bits >> k) & 1;
+            }
+        }
+#elif defined(__SSE4_2__)
+        const __m128i constant = _mm_set1_epi64x(value);
+        for (; r + 2 <= count; r += 2) {
+            __m128i chunk = _mm_loadu_si128(reinterpret_cast<const __m128i*>(values + 8 * r));
+            __m128i mask;
+            switch (op) {
+                case OP_EQ: mask = _mm_cmpeq_epi64(chunk, constant); break;
+                case OP_NE: mask = _mm_xor_si128(_mm_cmpeq_epi64(chunk, constant), _mm_set1_epi64x(-1)); break;
+                case OP_LT: mask = _mm_cmpgt_epi64(constant, chunk); break;
+                case OP_GT: mask = _mm_cmpgt_epi64(chunk, constant); break;
+                case OP_LE: mask = _mm_xor_si128(_mm_cmpgt_epi64(chunk, constant), _mm_set1_epi64x(-1)); break;
+                default: mask = _mm_xor_si128(_mm_cmpgt_epi64(constant, chunk), _mm_set1_epi64x(-1)); break;
+            }
+            int bits = _mm_movemask_pd(_mm_castsi128_pd(mask));
+            sel[r] = bits & 1;
+            sel[r + 1] = (bits >> 1) & 1;
+        }
+#endif
+        switch (op) {
+            case OP_EQ: for (; r < count; ++r) sel[r] = load<long long>(values + 8 * r) == value; break;
+            case OP_NE: for (; r < count; ++r) sel[r] = load<long long>(values + 8 * r) != value; break;
+            case OP_LT: for (; r < count; ++r) sel[r] = load<long long>(values + 8 * r) < value; break;
+            case OP_GT: for (; r < count; ++r) sel[r] = load<long long>(values + 8 * r) > value; break;
+            case OP_LE: for (; r < count; ++r) sel[r] = load<long long>(values + 8 * r) <= value; break;
+            default: for (; r < count; ++r) sel[r] = load<long long>(values + 8 * r) >= value; break;
+        }
+    }
+
+    static void equal_doubles(const char* values, int count, bool negate, double value, uint8_t* sel) {
+        for (int r = 0; r < count; ++r) {
+            sel[r] = (load<double>(values + 8 * r) == value) != negate;
+        }
+    }
+
+    // Текст одной ячейки; buffer нужен числам и должен жить, пока используется результат
+    static FieldSpan cell_text(const Block& block, int r, char* buffer) {
+        if (block.type == COL_STRING) {
+            return block.entry(load<uint32_t>(block.values + 4 * r));
+        }
+        to_chars_result printed = block.type == COL_INT64
+            ? to_chars(buffer, buffer + 32, load<long long>(block.values + 8 * r))
+            : to_chars(buffer, buffer + 32, load<double>(block.values + 8 * r));
+        return {buffer, (size_t)(printed.ptr - buffer)};
+    }
+
+    // Первый элемент словаря, для которого compare_text(элемент, literal) >= 0 (или > 0 при after_equal)
+    static uint32_t dict_bound(const Block& block, const FieldSpan& literal, bool after_equal) {
+        uint32_t low = 0;
+        uint32_t high = block.dict_size;
+        while (low < high) {
+            uint32_t middle = low + (high - low) / 2;
+            int cmp = WhereCond::compare_text(block.entry(middle), literal);
+            if (cmp < 0 || (after_equal && cmp == 0)) {
+                low = middle + 1;
+            } else {
+                high = middle;
+            }
+        }
+        return low;
+    }
+
+    // Ядро выбора по кодам словаря: sel[r] = 1, если код в [low, high) (или вне его при negate)
+    static void select_codes(const char* codes, int count, uint32_t low, uint32_t high, bool negate, uint8_t* sel) {
+        uint32_t width = high - low;
+        int r = 0;
+#if defined(__SSE2__)
+        // Беззнаковое code - low < width через знаковое сравнение со сдвигом на 2^31
+        const __m128i bias = _mm_set1_epi32((int)0x80000000u);
+        const __m128i base = _mm_set1_epi32((int)low);
+        const __m128i limit = _mm_xor_si128(_mm_set1_epi32((int)width), bias);
+        for (; r + 4 <= count; r += 4) {
+            __m128i chunk = _mm_loadu_si128(reinterpret_cast<const __m128i*>(codes + 4 * r));
+            __m128i shifted = _mm_xor_si128(_mm_sub_epi32(chunk, base), bias);
+            int bits = _mm_movemask_ps(_mm_castsi128_ps(_mm_cmplt_epi32(shifted, limit)));
+            for (int k = 0; k < 4; ++k) {
+                sel[r + k] = ((bits >> k) & 1) != negate;
+            }
+        }
+#endif
+        for (; r < count; ++r) {
+            sel[r] = (load<uint32_t>(codes + 4 * r) - low < width) != negate;
+        }
+    }
+
+    // Вектор выбора одного сравнения по всему блоку: sel[r] = 1, если строка r ему удовлетворяет.
+    // Целые и дробные сравниваются ядрами по значениям, строки — один раз на элемент словаря,
+    // остальные случаи (сравнение колонок, текстовый порядок чисел) — построчно по тексту ячеек.
+    template <class BlockOf>
+    void filter_cond(const WhereCond& cond, int chunk_rows, BlockOf& block_of, uint8_t* sel) const {
+        if (cond.slot != 0 || cond.col_index >= columns || (cond.rhs_slot >= 0 && (cond.rhs_slot != 0 || cond.rhs_index >= columns))) {
+            memset(sel, 0, chunk_rows);  // Ячейки нет ни в одной строке
+            return;
+        }
+        const Block& block = block_of(cond.col_index);
+        bool equality = cond.op == OP_EQ || cond.op == OP_NE;
+        if (cond.rhs_slot < 0) {
+            FieldSpan literal{cond.literal.data(), cond.literal.size()};
+            if (block.type == COL_INT64 && (equality || cond.is_number)) {
+                long long value = cond.number;
+                if (equality && !as_int(literal, value)) {
+                    memset(sel, cond.op == OP_NE, chunk_rows);  // Литерал не каноническое целое — совпадений нет
+                    return;
+                }
+                compare_ints(block.values, chunk_rows, cond.op, value, sel);
+                return;
+            }
+            if (block.type == COL_DOUBLE && equality) {
+                double value;
+                if (!as_double(literal, value)) {
+                    memset(sel, cond.op == OP_NE, chunk_rows);
+                    return;
+                }
+                equal_doubles(block.values, chunk_rows, cond.op == OP_NE, value, sel);
+                return;
+            }
+            if (block.type == COL_STRING && (equality || !cond.is_number)) {
+                // Словарь отсортирован по compare_text: подходящие элементы образуют отрезок кодов
+                uint32_t first_equal = dict_bound(block, literal, false);
+                uint32_t after_equal = dict_bound(block, literal, true);
+                switch (cond.op) {
+                    case OP_EQ: select_codes(block.values, chunk_rows, first_equal, after_equal, false, sel); break;
+                    case OP_NE: select_codes(block.values, chunk_rows, first_equal, after_equal, true, sel); break;
+                    case OP_LT: select_codes(block.values, chunk_rows, 0, first_equal, false, sel); break;
+                    case OP_LE: select_codes(block.values, chunk_rows, 0, after_equal, false, sel); break;
+                    case OP_GT: select_codes(block.values, chunk_rows, after_equal, block.dict_size, false, sel); break;
+                    default: select_codes(block.values, chunk_rows, first_equal, block.dict_size, false, sel); break;
+                }
+                return;
+            }
+            if (block.type == COL_STRING) {
+                // Числовой порядок для ячеек-чисел: условие вычисляется один раз на элемент словаря
+                vector<uint8_t> dict_sel(block.dict_size);
+                RowFields cell;
+                cell.fields.assign(cond.col_index + 1, FieldSpan{"", 0});
+                for (uint32_t d = 0; d < block.dict_size; ++d) {
+                    cell.fields[cond.col_index] = block.entry(d);
+                    dict_sel[d] = cond.matches(cell);
+                }
+                for (int r = 0; r < chunk_rows; ++r) {
+                    sel[r] = dict_sel[load<uint32_t>(block.values + 4 * r)];
+                }
+                return;
+            }
+        }
+
+        RowFields row;
+        row.fields.assign(columns, FieldSpan{"", 0});
+        char buffer[32];
+        char other_buffer[32];
+        const Block* other = cond.rhs_slot >= 0 ? &block_of(cond.rhs_index) : nullptr;
+        for (int r = 0; r < chunk_rows; ++r) {
+            row.fields[cond.col_index] = cell_text(block, r, buffer);
+            if (other) {
+                row.fields[cond.rhs_index] = cell_text(*other, r, other_buffer);
+            }
+            sel[r] = cond.matches(row);
+        }
+    }
+
+    // Пакетное выполнение по блокам: условие вычисляется векторами выбора по колонкам (AND внутри группы,
+    // OR между группами), а текст колонок output печатается только для выбранных строк.
+    // visit получает строки, удовлетворяющие условию, с ячейками только из колонок output (остальные пустые).
+    template <class Visit>
+    void scan(const vector<bool>& output, const WherePredicate& predicate, Visit visit) const {
+        const char* p = map + HEADER_SIZE;
+        const char* end = map + map_size;
+        vector<const char*> blocks(columns);
+        vector<Block> decoded(columns);
+        vector<bool> ready(columns);
+        vector<uint8_t> selected;
+        vector<uint8_t> group;
+        vector<uint8_t> cond_sel;
+        vector<char> buffers(columns * 32);
+        RowFields fields;
+        fields.fields.assign(columns, FieldSpan{"", 0});
+
+        for (int chunk = 0; chunk < chunks && p + sizeof(int) <= end; ++chunk) {
+            int chunk_rows = load<int>(p);
+            p += sizeof(int);
+            for (int c = 0; c < columns; ++c) {
+                blocks[c] = p + sizeof(long long);
+                p += sizeof(long long) + load<long long>(p);
+            }
+            if (p > end) {
+                return;
+            }
+
+            ready.assign(columns, false);
+            auto block_of = [&](int c) -> const Block& {
+                if (!ready[c]) {
+                    decoded[c] = decode(blocks[c]);
+                    ready[c] = true;
+                }
+                return decoded[c];
+            };
+
+            if (!predicate.valid) {
+                return;
+            }
+            bool possible = predicate.any_of.empty();
+            for (size_t g = 0; g < predicate.any_of.size() && !possible; ++g) {
+                possible = true;
+                for (const WhereCond& cond : predicate.any_of[g]) {
+                    if (cond.slot == 0 && cond.rhs_slot < 0 && cond.col_index < columns &&
+                        excludes(block_of(cond.col_index), cond)) {
+                        possible = false;  // Блок пропускается по min/max без чтения значений
+                        break;
+                    }
+                }
+            }
+            if (!possible) {
+                continue;
+            }
+
+            selected.assign(chunk_rows, predicate.any_of.empty());
+            cond_sel.resize(chunk_rows);
+            for (const vector<WhereCond>& all_of : predicate.any_of) {
+                group.assign(chunk_rows, 1);
+                for (const WhereCond& cond : all_of) {
+                    filter_cond(cond, chunk_rows, block_of, cond_sel.data());
+                    for (int r = 0; r < chunk_rows; ++r) {
+                        group[r] &= cond_sel[r];
+                    }
+                }
+                for (int r = 0; r < chunk_rows; ++r) {
+                    selected[r] |= group[r];
+                }
+            }
+
+            for (int r = 0; r < chunk_rows; ++r) {
+                if (!selected[r]) {
+                    continue;
+                }
+                for (int c = 0; c < columns; ++c) {
+                    if (output[c]) {
+                        fields.fields[c] = cell_text(block_of(c), r, &buffers[c * 32]);
+                    }
+                }
+                if (!visit(fields)) {
+                    return;  // Вызывающему больше не нужны строки этого сегмента
+                }
+            }
+        }
+    }
+};
+
+// Карта зон запечатанного сегмента (N.zone): по каждой колонке min/max ключей ячеек (текст без пробелов и кавычек),
+// min/max чисел, если числа все ячейки, и фильтр Блума ключей для равенства. По ней сегменты, где условие
+// заведомо не выполняется, не читаются. Удаление пометкой строку из карты не убирает: карта остается надмножеством.
+struct ZoneMap {
+    static constexpr char MAGIC[8] = {'P', '1', 'Z', 'O', 'N', '0', '0', '1'};
+    static const size_t HEADER_SIZE = 8 + 8 + 4 * 2;
+    static const int BLOOM_BITS_PER_ROW = 8;
+    static const int BLOOM_PROBES = 5;  // При 8 битах на строку — не больше 2% ложных срабатываний
+
+    // Заголовок: сигнатура, размер CSV и число строк сегмента на момент построения, колонок; затем смещения колонок
+    long long csv_bytes = -1;
+    int rows = 0;
+    int columns = 0;
+
+    char* map = nullptr;
+    size_t map_size = 0;
+
+    // Колонка после разбора: значения остаются в отображении файла
+    struct Column {
+        bool numeric;
+        long long min_number, max_number;
+        string_view min_key, max_key;
+        uint32_t bloom_words;  // Степень двойки
+        const char* bloom;
+    };
+
+    ZoneMap() = default;
+    ZoneMap(const ZoneMap&) = delete;
+    ZoneMap& operator=(const ZoneMap&) = delete;
+
+    ~ZoneMap() {
+        if (map) {
+            munmap(map, map_size);
+        }
+    }
+
+    static uint64_t key_hash(string_view key) {
+        uint64_t hash = 14695981039346656037ULL;  // FNV-1a с перемешиванием splitmix64
+        for (char c : key) {
+            hash = (hash ^ (unsigned char)c) * 1099511628211ULL;
+        }
+        hash = (hash ^ (hash >> 30)) * 0xbf58476d1ce4e5b9ULL;
+        hash = (hash ^ (hash >> 27)) * 0x94d049bb133111ebULL;
+        return hash ^ (hash >> 31);
+    }
+
+    // Колонка: признак чисел, min/max чисел, min/max ключей, фильтр Блума ключей.
+    // Фильтр рассчитан на число строк, а не различных ключей: так карта строится за один проход без сортировки.
+    static void encode_column(const vector<string_view>& keys, const vector<long long>& numbers, bool numeric, string& out) {
+        ColumnarSegment::put<uint8_t>(out, numeric && !numbers.empty());
+        ColumnarSegment::put<long long>(out, numbers.empty() ? 0 : *min_element(numbers.begin(), numbers.end()));
+        ColumnarSegment::put<long long>(out, numbers.empty() ? 0 : *max_element(numbers.begin(), numbers.end()));
+        auto [min_key, max_key] = minmax_element(keys.begin(), keys.end());
+        for (string_view key : {*min_key, *max_key}) {
+            ColumnarSegment::put<uint32_t>(out, key.size());
+            out += key;
+        }
+        uint32_t words = 1;
+        while ((uint64_t)words * 64 < keys.size() * BLOOM_BITS_PER_ROW) {
+            words *= 2;
+        }
+        vector<uint64_t> bloom(words, 0);
+        for (size_t k = 0; k < keys.size(); ++k) {
+            if (k > 0 && keys[k] == keys[k - 1]) {
+                continue;  // Соседние строки часто совпадают
+            }
+            uint64_t hash = key_hash(keys[k]);
+            uint64_t step = (hash >> 32) | 1;
+            for (int p = 0; p < BLOOM_PROBES; ++p, hash += step) {
+                uint64_t bit = hash & ((uint64_t)words * 64 - 1);
+                bloom[bit / 64] |= 1ULL << (bit % 64);
+            }
+        }
+        ColumnarSegment::put<uint32_t>(out, words);
+        out.append(reinterpret_cast<const char*>(bloom.data()), words * sizeof(uint64_t));
+    }
+
+    // Строит .zone по CSV-сегменту; false, если в сегменте есть строки с другим числом ячеек
+    static bool build(const string& csv_path, const string& zone_path, long long csv_bytes, int segment_rows, int column_count) {
+        SegmentReader reader;
+        if (!reader.open(csv_path)) {
+            return false;
+        }
+        const char* header;
+        size_t header_len;
+        reader.next_line(header, header_len);
+
+        // Ключи ссылаются на отображение сегмента; копируются только ячейки с пробелами или кавычками
+        vector<vector<string_view>> keys(column_count);
+        deque<string> stripped;
+        vector<vector<long long>> numbers(column_count);
+        vector<bool> numeric(column_count, true);
+        RowFields fields;
+        while (reader.next_row(fields)) {
+            if ((int)fields.fields.size() != column_count) {
+                return false;
+            }
+            for (int c = 0; c < column_count; ++c) {
+                const FieldSpan& cell = fields.fields[c];
+                if (any_of(cell.ptr, cell.ptr + cell.len, WhereCond::skipped)) {
+                    stripped.emplace_back();
+                    WhereCond::cell_key(cell, stripped.back());
+                    keys[c].push_back(stripped.back());
+                } else {
+                    keys[c].push_back(string_view(cell.ptr, cell.len));
+                }
+                long long value;
+                if (numeric[c] && WhereCond::parse_number(fields.fields[c], value)) {
+                    numbers[c].push_back(value);
+                } else {
+                    numeric[c] = false;
+                }
+            }
+        }
+
+        string out(MAGIC, 8);
+        ColumnarSegment::put<long long>(out, csv_bytes);
+        ColumnarSegment::put<int>(out, segment_rows);
+        ColumnarSegment::put<int>(out, keys[0].empty() ? 0 : column_count);  // Без живых строк колонок нет
+        size_t offsets_at = out.size();
+        if (!keys[0].empty()) {
+            out.append(4 * column_count, '\0');
+            for (int c = 0; c < column_count; ++c) {
+                uint32_t offset = out.size();
+                memcpy(&out[offsets_at + 4 * c], &offset, 4);
+                encode_column(keys[c], numbers[c], numeric[c], out);
+            }
+        }
+
+        string temp_path = zone_path + ".tmp";
+        ofstream file(temp_path, ios::binary | ios::trunc);
+        file.write(out.data(), out.size());
+        file.close();
+        if (!file) {
+            unlink(temp_path.c_str());
+            return false;
+        }
+        return rename(temp_path.c_str(), zone_path.c_str()) == 0;
+    }
+
+    static bool parse_header(const char* data, size_t size, ZoneMap& zones) {
+        if (size < HEADER_SIZE || memcmp(data, MAGIC, 8) != 0) {
+            return false;
+        }
+        zones.csv_bytes = ColumnarSegment::load<long long>(data + 8);
+        zones.rows = ColumnarSegment::load<int>(data + 16);
+        zones.columns = ColumnarSegment::load<int>(data + 20);
+        return size >= HEADER_SIZE + 4 * (size_t)zones.columns;
+    }
+
+    // Только заголовок: достаточно, чтобы проверить актуальность карты
+    bool read_header(const string& path) {
+        int fd = open(path.c_str(), O_RDONLY);
+        if (fd < 0) {
+            return false;
+        }
+        char header[HEADER_SIZE];
+        bool ok = pread(fd, header, HEADER_SIZE, 0) == (ssize_t)HEADER_SIZE && memcmp(header, MAGIC, 8) == 0;
+        if (ok) {
+            csv_bytes = ColumnarSegment::load<long long>(header + 8);
+            rows = ColumnarSegment::load<int>(header + 16);
+            columns = ColumnarSegment::load<int>(header + 20);
+        }
+        close(fd);
+        return ok;
+    }
+
+    bool open_map(const string& path) {
+        int fd = open(path.c_str(), O_RDONLY);
+        if (fd < 0) {
+            return false;
+        }
+        struct stat st;
+        if (fstat(fd, &st) != 0 || st.st_size < (off_t)HEADER_SIZE) {
+            close(fd);
+            return false;
+        }
+        map_size = st.st_size;
+        void* data = mmap(nullptr, map_size, PROT_READ, MAP_PRIVATE, fd, 0);
+        close(fd);
+        if (data == MAP_FAILED) {
+            map = nullptr;
+            return false;
+        }
+        map = static_cast<char*>(data);
+        return parse_header(map, map_size, *this);
+    }
+
+    Column column(int c) const {
+        const char* p = map + ColumnarSegment::load<uint32_t>(map + HEADER_SIZE + 4 * c);
+        Column column;
+        column.numeric = ColumnarSegment::load<uint8_t>(p);
+        column.min_number = ColumnarSegment::load<long long>(p + 1);
+        column.max_number = ColumnarSegment::load<long long>(p + 9);
+        p += 17;
+        for (string_view* key : {&column.min_key, &column.max_key}) {
+            uint32_t len = ColumnarSegment::load<uint32_t>(p);
+            *key = string_view(p + 4, len);
+            p += 4 + len;
+        }
+        column.bloom_words = ColumnarSegment::load<uint32_t>(p);
+        column.bloom = p + 4;
+        return column;
+    }
+
+    static bool bloom_contains(const Column& column, string_view key) {
+        uint64_t hash = key_hash(key);
+        uint64_t step = (hash >> 32) | 1;
+        for (int p = 0; p < BLOOM_PROBES; ++p, hash += step) {
+            uint64_t bit = hash & ((uint64_t)column.bloom_words * 64 - 1);
+            if (!(ColumnarSegment::load<uint64_t>(column.bloom + bit / 64 * 8) >> (bit % 64) & 1)) {
+                return false;
+            }
+        }
+        return true;
+    }
+
+    // true, если ни одна строка сегмента заведомо не удовлетворяет сравнению с литералом (семантика WhereCond::matches)
+    bool excludes(const WhereCond& cond) const {
+        if (cond.col_index >= columns) {
+            return true;  // Живых строк нет или ячейки такой нет ни в одной строке
+        }
+        Column zone = column(cond.col_index);
+        string key;
+        WhereCond::cell_key(FieldSpan{cond.literal.data(), cond.literal.size()}, key);
+        if (cond.op == OP_EQ) {
+            return key < zone.min_key || key > zone.max_key || !bloom_contains(zone, key);
+        }
+        if (cond.op == OP_NE) {
+            return zone.min_key == key && zone.max_key == key;
+        }
+        if (cond.is_number) {
+            if (!zone.numeric) {
+                return false;  // Числовые ячейки сравниваются численно, остальные — как текст
+            }
+            switch (cond.op) {
+                case OP_LT: return zone.min_number >= cond.number;
+                case OP_LE: return zone.min_number > cond.number;
+                case OP_GT: return zone.max_number <= cond.number;
+                default: return zone.max_number < cond.number;
+            }
+        }
+        switch (cond.op) {
+            case OP_LT: return zone.min_key >= key;
+            case OP_LE: return zone.min_key > key;
+            case OP_GT: return zone.max_key <= key;
+            default: return zone.max_key < key;
+        }
+    }
+
+    // true, если условию заведомо не удовлетворяет ни одна строка: каждая OR-группа содержит исключенное сравнение.
+    // Учитываются только сравнения ячеек таблицы slot с литералами.
+    bool excludes(const WherePredicate& predicate, int slot) const {
+        if (!predicate.valid || predicate.any_of.empty()) {
+            return false;
+        }
+        for (const vector<WhereCond>& all_of : predicate.any_of) {
+            bool excluded = false;
+            for (const WhereCond& cond : all_of) {
+                if (cond.slot == slot && cond.rhs_slot < 0 && excludes(cond)) {
+                    excluded = true;
+                    break;
+                }
+            }
+            if (!excluded) {
+                return false;
+            }
+        }
+        return true;
+    }
+};
+
+// Формат результатов: TEXT — "колонка - значение" по строке на ячейку с заголовком (по умолчанию),
+// CSV и TSV — строка имен колонок и строка на запись, JSONL — JSON-объект на запись,
+// BINARY — "P1RS", u32 число колонок, имена и ячейки как [u32 длина][байты], в конце u32 0xFFFFFFFF
+enum ResultFormat { FORMAT_TEXT, FORMAT_CSV, FORMAT_TSV, FORMAT_JSONL, FORMAT_BINARY };
+
+static bool parse_result_format(string name, ResultFormat& format) {
+    transform(name.begin(), name.end(), name.begin(), ::tolower);
+    if (name == "text") format = FORMAT_TEXT;
+    else if (name == "csv") format = FORMAT_CSV;
+    else if (name == "tsv") format = FORMAT_TSV;
+    else if (name == "jsonl") format = FORMAT_JSONL;
+    else if (name == "binary") format = FORMAT_BINARY;
+    else return false;
+    return true;
+}
+
+// Кодирует строки результата в выбранном формате; без состояния, вызывается из рабочих потоков
+struct RowEncoder {
+    ResultFormat format;
+    const string* columns;  // Имена колонок результата
+
+    static void put_length(string& out, size_t len) {
+        uint32_t value = len;
+        out.append(reinterpret_cast<const char*>(&value), sizeof(value));
+    }
+
+    static void json_string(string& out, const char* ptr, size_t len) {
+        out += '"';
+        for (size_t i = 0; i < len; ++i) {
+            unsigned char c = ptr[i];
+            if (c == '"' || c == '\\') {
+                out += '\\';
+                out += c;
+            } else if (c < 0x20) {
+                char escaped[8];
+                snprintf(escaped, sizeof(escaped), "\\u%04x", c);
+                out += escaped;
+            } else {
+                out += c;
+            }
+        }
+        out += '"';
+    }
+
+    void begin(string& out) const {
+        if (format == FORMAT_JSONL) {
+            out += '{';
+        }
+    }
+
+    // k-я ячейка строки
+    void cell(size_t k, const char* ptr, size_t len, string& out) const {
+        switch (format) {
+            case FORMAT_TEXT:
+                out += columns[k];
+                out += " - ";
+                out.append(ptr, len);
+                out += '\n';
+                break;
+            case FORMAT_CSV:
+                if (k > 0) out += ',';
+                if (memchr(ptr, ',', len) || memchr(ptr, '"', len) || memchr(ptr, '\n', len) || memchr(ptr, '\r', len)) {
+                    out += '"';
+                    for (size_t i = 0; i < len; ++i) {
+                        if (ptr[i] == '"') out += '"';
+                        out += ptr[i];
+                    }
+                    out += '"';
+                } else {
+                    out.append(ptr, len);
+                }
+                break;
+            case FORMAT_TSV:
+                if (k > 0) out += '\t';
+                for (size_t i = 0; i < len; ++i) {
+                    char c = ptr[i];
+                    if (c == '\t') out += "\\t";
+                    else if (c == '\n') out += "\\n";
+                    else if (c == '\r') out += "\\r";
+                    else if (c == '\\') out += "\\\\";
+                    else out += c;
+                }
+                break;
+            case FORMAT_JSONL:
+                if (k > 0) out += ',';
+                json_string(out, columns[k].data(), columns[k].size());
+                out += ':';
+                json_string(out, ptr, len);
+                break;
+            case FORMAT_BINARY:
+                put_length(out, len);
+                out.append(ptr, len);
+                break;
+        }
+    }
+
+    void end(string& out) const {
+        if (format == FORMAT_JSONL) {
+            out += "}\n";
+        } else if (format == FORMAT_CSV || format == FORMAT_TSV) {
+            out += '\n';
+        }
+    }
+};
+
+// Приемник результатов запроса: закодированные строки копятся в буфере и пишутся в out кусками
+// по FLUSH_BYTES, без сброса потока на каждой строке. Служебные сообщения (INSERT выполнен, удалено
+// строк и т. п.) идут в diag: в TEXT это тот же out, в остальных форматах — cerr, чтобы данные не смешивались.
+struct ResultSink {
+    static const size_t FLUSH_BYTES = 1 << 20;
+    static ResultFormat default_format;  // --format
+
+    ResultFormat format;
+    ostream& out;
+    ostream& diag;
+    string buffer;
+    string title;  // TEXT: заголовок перед первой строкой
+    vector<string> columns;
+    bool has_rows = false;
+    double write_seconds = 0;  // Время записи в out (EXPLAIN ANALYZE)
+    long long bytes_written = 0;
+
+    explicit ResultSink(ostream& data, ResultFormat result_format = FORMAT_TEXT)
+        : format(result_format), out(data), diag(result_format == FORMAT_TEXT ? data : cerr) {}
+
+    ResultSink(const ResultSink&) = delete;
+    ResultSink& operator=(const ResultSink&) = delete;
+
+    RowEncoder encoder() const {
+        return RowEncoder{format, columns.data()};
+    }
+
+    // Начало результата: CSV, TSV и BINARY сразу пишут имена колонок, TEXT — заголовок перед первой строкой
+    void begin(const string& result_title, const string names[], size_t count) {
+        title = result_title;
+        columns.assign(names, names + count);
+        has_rows = false;
+        if (format == FORMAT_CSV || format == FORMAT_TSV) {
+            RowEncoder header{format, columns.data()};
+            for (size_t k = 0; k < count; ++k) {
+                header.cell(k, names[k].data(), names[k].size(), buffer);
+            }
+            header.end(buffer);
+        } else if (format == FORMAT_BINARY) {
+            buffer += "P1RS";
+            RowEncoder::put_length(buffer, count);
+            for (size_t k = 0; k < count; ++k) {
+                RowEncoder::put_length(buffer, names[k].size());
+                buffer += names[k];
+            }
+        }
+    }
+
+    // Закодированные строки (одна или несколько подряд)
+    void append(const string& rows) {
+        if (rows.empty()) {
+            return;
+        }
+        if (!has_rows && format == FORMAT_TEXT) {
+            buffer += title;
+            buffer += '\n';
+        }
+        has_rows = true;
+        if (buffer.size() + rows.size() > FLUSH_BYTES && !buffer.empty()) {
+            flush();
+        }
+        if (rows.size() > FLUSH_BYTES) {
+            write_out(rows.data(), rows.size());  // Большой кусок пишется без копирования в буфер
+        } else {
+            buffer += rows;
+        }
+    }
+
+    void flush() {
+        write_out(buffer.data(), buffer.size());
+        buffer.clear();
+    }
+
+    void write_out(const char* data, size_t size) {
+        auto started = chrono::steady_clock::now();
+        out.write(data, size);
+        write_seconds += chrono::duration<double>(chrono::steady_clock::now() - started).count();
+        bytes_written += size;
+    }
+
+    // Конец результата; в TEXT без строк печатается сообщение об отсутствии данных
+    void finish() {
+        if (!has_rows && format == FORMAT_TEXT) {
+            buffer += "Нет данных, соответствующих условиям.\n";
+        } else if (format == FORMAT_BINARY) {
+            RowEncoder::put_length(buffer, 0xFFFFFFFFu);
+        }
+        flush();
+        auto started = chrono::steady_clock::now();
+        out.flush();
+        write_seconds += chrono::duration<double>(chrono::steady_clock::now() - started).count();
+    }
+
+    // Результаты сегментов по порядку
+    void write(const string& result_title, const string names[], size_t count, const vector<string>& results) {
+        begin(result_title, names, count);
+        for (const string& result : results) {
+            append(result);
+        }
+        finish();
+    }
+};
+
+ResultFormat ResultSink::default_format = FORMAT_TEXT;
+
+// Поток, отбрасывающий все записанное: результат EXPLAIN ANALYZE вычисляется, но не выводится
+class DiscardStreambuf : public streambuf {
+protected:
+    int overflow(int c) override {
+        return c == EOF ? 0 : c;
+    }
+
+    streamsize xsputn(const char*, streamsize count) override {
+        return count;
+    }
+};
+
+// ORDER BY и LIMIT одиночного SELECT; limit < 0 — без ограничения
+struct SortSpec {
+    string column;
+    bool descending = false;
+    long long limit = -1;
+};
+
+// Строка результата с ключом сортировки: числа идут раньше текста, числа сравниваются по значению,
+// текст — через compare_text; при равных ключах сохраняется порядок в таблице (seq)
+struct SortRow {
+    bool is_text;
+    double number;
+    string key;
+    long long seq;
+    string output;  // Уже напечатанные колонки строки
+
+    size_t bytes() const {
+        return sizeof(SortRow) + key.size() + output.size();
+    }
+};
+
+struct RowOrder {
+    bool descending;
+
+    // true, если a выводится раньше b
+    bool operator()(const SortRow& a, const SortRow& b) const {
+        int cmp;
+        if (a.is_text != b.is_text) {
+            cmp = a.is_text ? 1 : -1;
+        } else if (!a.is_text) {
+            cmp = a.number < b.number ? -1 : (a.number > b.number ? 1 : 0);
+        } else {
+            cmp = WhereCond::compare_text(FieldSpan{a.key.data(), a.key.size()}, FieldSpan{b.key.data(), b.key.size()});
+        }
+        if (cmp != 0) {
+            return descending ? cmp > 0 : cmp < 0;
+        }
+        return a.seq < b.seq;
+    }
+};
+
+// Внешняя сортировка: сегменты копят строки в памяти, а когда общий объем превышает бюджет,
+// поток, переполнивший его, сортирует свой буфер и сбрасывает его на диск отдельным прогоном.
+// В конце отсортированные прогоны (на диске и в памяти) сливаются кучей прямо в вывод.
+struct RowSorter {
+    static size_t memory_budget;  // --sort-memory, байт
+
+    RowOrder order;
+    string directory;  // Каталог таблицы для временных прогонов
+    atomic<size_t> in_memory{0};
+    pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+    vector<string> run_files;
+    vector<vector<SortRow>> memory_runs;
+
+    RowSorter(bool descending, const string& dir) : order{descending}, directory(dir) {}
+
+    RowSorter(const RowSorter&) = delete;
+    RowSorter& operator=(const RowSorter&) = delete;
+
+    ~RowSorter() {
+        for (const string& file : run_files) {
+            unlink(file.c_str());
+        }
+    }
+
+    static void make_key(const FieldSpan& cell, SortRow& row, string& scratch) {
+        bool is_int;
+        long long integer;
+        row.is_text = !AggregateState::cell_number(cell, row.number, is_int, integer, scratch);
+        if (row.is_text) {
+            row.key.assign(cell.ptr, cell.len);
+            row.number = 0;
+        }
+    }
+
+    // Учитывает строку в буфере сегмента; при превышении бюджета буфер уходит на диск
+    void add(vector<SortRow>& buffer, size_t& buffer_bytes, SortRow&& row) {
+        size_t bytes = row.bytes();
+        buffer.push_back(move(row));
+        buffer_bytes += bytes;
+        if (in_memory.fetch_add(bytes) + bytes > memory_budget) {
+            spill(buffer);
+            in_memory.fetch_sub(buffer_bytes);
+            buffer_bytes = 0;
+        }
+    }
+
+    template <class T>
+    static void put(string& out, T value) {
+        out.append(reinterpret_cast<const char*>(&value), sizeof(T));
+    }
+
+    static void put_string(string& out, const string& value) {
+        put<uint32_t>(out, value.size());
+        out += value;
+    }
+
+    void spill(vector<SortRow>& buffer) {
+        sort(buffer.begin(), buffer.end(), order);
+        static atomic<long long> run_counter{0};
+        string path = directory + "/sort_" + to_string(getpid()) + "_" + to_string(run_counter++) + ".run";
+        ofstream file(path, ios::binary | ios::trunc);
+        string record;
+        for (const SortRow& row : buffer) {
+            record.clear();
+            put<uint8_t>(record, row.is_text);
+            put<double>(record, row.number);
+            put<long long>(record, row.seq);
+            put_string(record, row.key);
+            put_string(record, row.output);
+            file.write(record.data(), record.size());
+        }
+        file.close();
+        vector<SortRow>().swap(buffer);
+
+        pthread_mutex_lock(&lock);
+        run_files.push_back(path);
+        pthread_mutex_unlock(&lock);
+        if (!file) {
+            cerr << "Ошибка записи временного файла сортировки " << path << endl;
+        }
+    }
+
+    // Остаток буфера сегмента становится прогоном в памяти
+    void finish(vector<SortRow>& buffer) {
+        if (buffer.empty()) {
+            return;
+        }
+        sort(buffer.begin(), buffer.end(), order);
+        pthread_mutex_lock(&lock);
+        memory_runs.push_back(move(buffer));
+        pthread_mutex_unlock(&lock);
+    }
+
+    static bool read_row(ifstream& file, SortRow& row) {
+        uint8_t is_text;
+        uint32_t size;
+        if (!file.read(reinterpret_cast<char*>(&is_text), 1)) {
+            return false;
+        }
+        row.is_text = is_text;
+        file.read(reinterpret_cast<char*>(&row.number), sizeof(row.number));
+        file.read(reinterpret_cast<char*>(&row.seq), sizeof(row.seq));
+        file.read(reinterpret_cast<char*>(&size), sizeof(size));
+        row.key.resize(size);
+        file.read(&row.key[0], size);
+        file.read(reinterpret_cast<char*>(&size), sizeof(size));
+        row.output.resize(size);
+        file.read(&row.output[0], size);
+        return (bool)file;
+    }
+
+    // k-путевое слияние прогонов; выводит не больше limit строк (limit < 0 — все), возвращает число строк
+    long long merge(ResultSink& sink, long long limit) {
+        size_t memory_count = memory_runs.size();
+        vector<size_t> positions(memory_count, 0);
+        vector<ifstream> files;
+        for (const string& path : run_files) {
+            files.emplace_back(path, ios::binary);
+        }
+        vector<SortRow> heads(memory_count + files.size());
+
+        // Куча номеров источников: на вершине источник, чья текущая строка выводится первой
+        auto later = [&](size_t a, size_t b) {
+            return order(heads[b], heads[a]);
+        };
+        vector<size_t> heap;
+        auto advance = [&](size_t source) {
+            if (source < memory_count) {
+                if (positions[source] < memory_runs[source].size()) {
+                    heads[source] = move(memory_runs[source][positions[source]++]);
+                    return true;
+                }
+                return false;
+            }
+            return read_row(files[source - memory_count], heads[source]);
+        };
+        for (size_t source = 0; source < heads.size(); ++source) {
+            if (advance(source)) {
+                heap.push_back(source);
+            }
+        }
+        make_heap(heap.begin(), heap.end(), later);
+
+        long long printed = 0;
+        while (!heap.empty() && (limit < 0 || printed < limit)) {
+            pop_heap(heap.begin(), heap.end(), later);
+            size_t source = heap.back();
+            printed++;
+            sink.append(heads[source].output);
+            if (advance(source)) {
+                push_heap(heap.begin(), heap.end(), later);
+            } else {
+                heap.pop_back();
+            }
+        }
+        return printed;
+    }
+};
+
+size_t RowSorter::memory_budget = 64 << 20;
+
+enum FsyncPolicy {
+    FSYNC_COMMIT,  // fdatasync журнала до ответа на каждое изменение (с групповой фиксацией)
+    FSYNC_INTERVAL,  // fdatasync фоновым потоком раз в interval_ms
+    FSYNC_OS  // Журнал сбрасывает на диск ОС
+};
+
+// Журнал предзаписи схемы (<schema>/wal): изменение сначала попадает сюда и только потом в сегменты.
+// Запись: длина и контрольная сумма FNV-1a по 4 байта, затем текст записи. Оборванная запись в хвосте отбрасывается.
+// Контрольная точка сбрасывает файлы схемы на диск и обнуляет журнал.
+struct WriteAheadLog {
+    string path;
+    int fd = -1;
+    FsyncPolicy policy = FSYNC_COMMIT;
+    int interval_ms = 0;
+
+    pthread_mutex_t lock;
+    pthread_cond_t synced_cond;  // Завершился очередной fdatasync
+    long long written = 0;  // Байт записано в журнал
+    long long synced = 0;  // Байт журнала гарантированно на диске
+    bool syncing = false;  // Какой-то поток выполняет fdatasync за всю группу
+    pthread_rwlock_t checkpoint_lock;  // Изменения держат его разделяемо, контрольная точка — исключительно
+
+    pthread_t flusher;
+    bool flusher_running = false;
+    bool stopping = false;
+
+    static const long long CHECKPOINT_BYTES = 64LL << 20;  // Размер журнала, после которого делается контрольная точка
+
+    WriteAheadLog() {
+        pthread_mutex_init(&lock, nullptr);
+        pthread_cond_init(&synced_cond, nullptr);
+        pthread_rwlock_init(&checkpoint_lock, nullptr);
+    }
+
+    WriteAheadLog(const WriteAheadLog&) = delete;
+    WriteAheadLog& operator=(const WriteAheadLog&) = delete;
+
+    ~WriteAheadLog() {
+        if (flusher_running) {
+            pthread_mutex_lock(&lock);
+            stopping = true;
+            pthread_mutex_unlock(&lock);
+            pthread_join(flusher, nullptr);
+        }
+        if (fd >= 0) {
+            close(fd);
+        }
+        pthread_rwlock_destroy(&checkpoint_lock);
+        pthread_cond_destroy(&synced_cond);
+        pthread_mutex_destroy(&lock);
+    }
+
+    bool open(const string& wal_path, FsyncPolicy fsync_policy, int interval) {
+        path = wal_path;
+        policy = fsync_policy;
+        interval_ms = max(1, interval);
+        fd = ::open(path.c_str(), O_RDWR | O_CREAT | O_APPEND, 0644);
+        if (fd < 0) {
+            cerr << "Ошибка: Не удалось открыть журнал " << path << ": " << strerror(errno) << endl;
+            return false;
+        }
+        struct stat st;
+        fstat(fd, &st);
+        written = synced = st.st_size;
+        if (policy == FSYNC_INTERVAL) {
+            flusher_running = pthread_create(&flusher, nullptr, flush_loop, this) == 0;
+        }
+        return true;
+    }
+
+    static uint32_t checksum(const char* data, size_t size) {
+        uint32_t hash = 2166136261u;
+        for (size_t i = 0; i < size; ++i) {
+            hash = (hash ^ (unsigned char)data[i]) * 16777619u;
+        }
+        return hash;
+    }
+
+    // Дописывает запись одним write; возвращает позицию конца записи для commit или -1 при ошибке.
+    // Недописанная запись отрезается, чтобы следующие не легли после мусора
+    long long append(const string& payload) {
+        uint32_t header[2] = {(uint32_t)payload.size(), checksum(payload.data(), payload.size())};
+        string record(reinterpret_cast<const char*>(header), sizeof(header));
+        record += payload;
+
+        pthread_mutex_lock(&lock);
+        size_t done = 0;
+        while (done < record.size()) {
+            ssize_t n = write(fd, record.data() + done, record.size() - done);
+            if (n < 0 && errno == EINTR) {
+                continue;
+            }
+            if (n < 0) {
+                int error = errno;
+                if (done > 0 && ftruncate(fd, written) != 0) {
+                    cerr << "Ошибка: не удалось отрезать недописанную запись журнала " << path << endl;
+                }
+                pthread_mutex_unlock(&lock);
+                cerr << "Ошибка записи в журнал " << path << ": " << strerror(error) << endl;
+                return -1;
+            }
+            done += n;
+        }
+        written += record.size();
+        long long end = written;
+        pthread_mutex_unlock(&lock);
+        return end;
+    }
+
+    // Возвращается, когда запись с концом в end надежно на диске (для политики commit)
+    void commit(long long end) {
+        if (policy == FSYNC_COMMIT && end > 0) {
+            sync_to(end);
+        }
+    }
+
+    // Групповая фиксация: один поток делает fdatasync за все записи, дописанные к этому моменту,
+    // остальные ждут его результата вместо собственного вызова
+    void sync_to(long long end) {
+        pthread_mutex_lock(&lock);
+        while (synced < end) {
+            if (syncing) {
+                pthread_cond_wait(&synced_cond, &lock);
+                continue;
+            }
+            syncing = true;
+            long long target = written;
+            pthread_mutex_unlock(&lock);
+            fdatasync(fd);
+            pthread_mutex_lock(&lock);
+            synced = max(synced, target);
+            syncing = false;
+            pthread_cond_broadcast(&synced_cond);
+        }
+        pthread_mutex_unlock(&lock);
+    }
+
+    static void* flush_loop(void* arg) {
+        WriteAheadLog* wal = static_cast<WriteAheadLog*>(arg);
+        while (true) {
+            usleep(wal->interval_ms * 1000);
+            pthread_mutex_lock(&wal->lock);
+            bool stop = wal->stopping;
+            long long target = wal->written;
+            pthread_mutex_unlock(&wal->lock);
+            if (stop) {
+                return nullptr;
+            }
+            wal->sync_to(target);
+        }
+    }
+
+    // Читает целые записи журнала; оборванный или испорченный хвост обрезается
+    void read_all(vector<string>& records) {
+        records.clear();
+        long long pos = 0;
+        uint32_t header[2];
+        while (pread(fd, header, sizeof(header), pos) == (ssize_t)sizeof(header)) {
+            string payload(header[0], '\0');
+            if (pread(fd, &payload[0], header[0], pos + sizeof(header)) != (ssize_t)header[0] ||
+                checksum(payload.data(), payload.size()) != header[1]) {
+                break;
+            }
+            records.push_back(payload);
+            pos += sizeof(header) + header[0];
+        }
+        if (pos < written) {
+            cerr << "Журнал " << path << ": отброшен оборванный хвост " << written - pos << " байт" << endl;
+            ftruncate(fd, pos);
+            written = synced = pos;
+        }
+    }
+
+    // Изменение таблицы целиком (запись в журнал и в сегменты) не пересекается с контрольной точкой
+    void begin_change() {
+        pthread_rwlock_rdlock(&checkpoint_lock);
+    }
+
+    void end_change() {
+        pthread_rwlock_unlock(&checkpoint_lock);
+    }
+
+    bool needs_checkpoint() {
+        pthread_mutex_lock(&lock);
+        bool needed = written >= CHECKPOINT_BYTES;
+        pthread_mutex_unlock(&lock);
+        return needed;
+    }
+
+    // Сбрасывает на диск файлы схемы (сегменты, манифесты, индексы) и обнуляет журнал.
+    // force — сбросить, даже если журнал пуст: так фиксируются изменения, сделанные мимо журнала (COPY)
+    void checkpoint(const string& schema_dir, bool force = false) {
+        pthread_rwlock_wrlock(&checkpoint_lock);
+        pthread_mutex_lock(&lock);
+        while (syncing) {
+            pthread_cond_wait(&synced_cond, &lock);
+        }
+        if (written > 0 || force) {
+            int dir_fd = ::open(schema_dir.c_str(), O_RDONLY | O_DIRECTORY);
+            if (dir_fd >= 0 && syncfs(dir_fd) == 0) {
+                ftruncate(fd, 0);
+                fdatasync(fd);
+                written = synced = 0;
+            } else {
+                cerr << "Ошибка контрольной точки журнала " << path << ": " << strerror(errno) << endl;
+            }
+            if (dir_fd >= 0) {
+                close(dir_fd);
+            }
+        }
+        pthread_mutex_unlock(&lock);
+        pthread_rwlock_unlock(&checkpoint_lock);
+    }
+};
+
+struct Table {
+    string table_name;
+    vector<string> columns;  // Ровно по числу колонок схемы
+    int columns_count;
+    int tuples_limit;
+    string table_path;
+    TableLock table_lock;  // Объект для блокировки таблицы
+    int pk_sequence;  // Счетчик для первичного ключа
+    vector<int> segment_rows;  // Манифест: число строк в сегментах 1.csv, 2.csv, ... (без заголовка)
+    vector<long long> segment_bytes;  // Манифест: размер каждого сегмента в байтах
+    vector<int> segment_dead;  // Манифест: строки, удаленные по первичному ключу и помеченные TOMBSTONE
+    vector<ColumnIndex> indexes;  // Вторичные индексы, поддерживаются при вставке и удалении
+    vector<RowLocation> pk_locations;  // Индекс первичного ключа: pk -> (сегмент, смещение строки)
+    WriteAheadLog* wal = nullptr;  // Журнал схемы; nullptr, пока журнал проигрывается при открытии
+    bool columnar = false;  // STORAGE COLUMNAR: у запечатанных сегментов поддерживаются колоночные копии N.col
+
+    int cache_id;  // Номер открытой таблицы в ключах SegmentCache
+    bool opened = false;  // false — таблица занята другим процессом, объект нужно удалить
+    mutable ExecCounters counters;  // Накопительная статистика запросов к таблице (SHOW STATS)
+
+    static long long compact_rate;  // --compact-rate, байт в секунду; 0 — фоновое уплотнение выключено
+    static const size_t COMPACT_WINDOW = 8;  // Сегментов в одном шаге уплотнения
+
+    Table() : tuples_limit(0), pk_sequence(1) {}
+
+    Table(const string& name, const vector<string>& cols, int limit, const string& schema_name)
+        : columns(cols), columns_count(cols.size()), tuples_limit(limit), pk_sequence(1) {
+        table_name = name;
+        table_path = schema_name + "/" + table_name; // Формируем путь к файлу таблицы
+        static atomic<int> tables_opened{0};
+        cache_id = ++tables_opened;
+
+    mkdir(table_path.c_str(), 0777);
+
+    if (!table_lock.processLock(table_path)) {
+        cerr << "Таблица " << table_name << " уже открыта другим процессом" << endl;
+        return;
+    }
+
+    // Счетчик продолжается с сохраненного значения: ключи не должны повторяться после перезапуска
+    ifstream saved_pk(table_path + "/" + table_name + "_pk_sequence");
+    if (!(saved_pk >> pk_sequence) || pk_sequence < 1) {
+        pk_sequence = 0;  // Файла нет или он испорчен: будет записан заново
+    }
+    saved_pk.close();
+    int saved_sequence = pk_sequence;
+    pk_sequence = max(pk_sequence, 1);
+
+    bool repaired = finish_compaction();
+    repaired = load_manifest() || repaired;
+    load_indexes(repaired);
+    load_pk_index(repaired);
+    load_columnar();
+    load_zones();
+
+    if (pk_sequence != saved_sequence) {  // Счетчик пишется, только если индекс первичного ключа его поднял
+        reserve_pk(0);
+    }
+    opened = true;
+}
+
+string segment_path(int segment) const {
+    return table_path + "/" + to_string(segment) + ".csv";
+}
+
+string manifest_path() const {
+    return table_path + "/" + table_name + "_manifest";
+}
+
+// Номер сегмента для вставки берется из манифеста: хвостовой или следующий, если хвост заполнен
+int get_next_segment() const {
+    int segments = segment_rows.size();
+    if (segments == 0 || segment_rows[segments - 1] >= tuples_limit) {
+        return segments + 1;
+    }
+    return segments;
+}
+
+string get_next_file() {
+    return segment_path(get_next_segment());
+}
+
+// Загружает манифест один раз при открытии таблицы; при отсутствии или расхождении с диском перестраивает его.
+// Возвращает true, если манифест пришлось исправить, — тогда производные файлы тоже могут быть устаревшими.
+bool load_manifest() {
+    ifstream manifest(manifest_path());
+    if (!manifest) {
+        rebuild_manifest();
+        return true;
+    }
+
+    string key;
+    int segments = 0;
+    manifest >> key >> segments;
+    if (key != "segments" || segments < 0) {
+        cerr << "Манифест таблицы " << table_name << " поврежден, перестраиваем" << endl;
+        rebuild_manifest();
+        return true;
+    }
+
+    segment_rows.assign(segments, 0);
+    segment_bytes.assign(segments, 0);
+    segment_dead.assign(segments, 0);
+    string line;
+    getline(manifest, line);
+    bool broken = false;  // Манифест не соответствует набору файлов — нужен полный обход
+    bool changed = false;  // Изменились отдельные сегменты — достаточно пересчитать их
+    for (int i = 0; i < segments && !broken; ++i) {
+        int segment = 0;
+        struct stat st;
+        getline(manifest, line);
+        istringstream fields(line);
+        if (!(fields >> segment >> segment_rows[i] >> segment_bytes[i]) || segment != i + 1 ||
+            stat(segment_path(segment).c_str(), &st) != 0) {
+            broken = true;
+        } else if (st.st_size != segment_bytes[i]) {
+            // Размер сверяем через stat, строки пересчитываем только у изменившихся сегментов
+            segment_rows[i] = get_row_count(segment_path(segment), &segment_dead[i]);
+            segment_bytes[i] = st.st_size;
+            changed = true;
+        } else if (!(fields >> segment_dead[i])) {
+            segment_dead[i] = 0;  // Манифест без счетчика удаленных строк
+        }
+    }
+    manifest.close();
+
+    struct stat st;
+    if (broken || stat(segment_path(segments + 1).c_str(), &st) == 0) {
+        rebuild_manifest();  // Включая случай, когда на диске есть сегменты, не попавшие в манифест
+        return true;
+    }
+    if (changed) {
+        save_manifest();
+    }
+    return changed;
+}
+
+// Полный обход сегментов 1.csv, 2.csv, ... с подсчетом строк
+void rebuild_manifest() {
+    segment_rows.clear();
+    segment_bytes.clear();
+    segment_dead.clear();
+    struct stat st;
+    for (int segment = 1; stat(segment_path(segment).c_str(), &st) == 0; ++segment) {
+        int dead = 0;
+        segment_rows.push_back(get_row_count(segment_path(segment), &dead));
+        segment_bytes.push_back(st.st_size);
+        segment_dead.push_back(dead);
+    }
+    save_manifest();
+}
+
+// Манифест пишется во временный файл и атомарно подменяется через rename.
+// Строка сегмента: номер, число строк, размер в байтах, число удаленных строк
+void save_manifest() {
+    string temp_path = manifest_path() + ".tmp";
+    ofstream manifest(temp_path);
+    manifest << "segments " << segment_rows.size() << "\n";
+    for (size_t i = 0; i < segment_rows.size(); ++i) {
+        manifest << i + 1 << " " << segment_rows[i] << " " << segment_bytes[i] << " " << segment_dead[i] << "\n";
+    }
+    manifest.close();
+    rename(temp_path.c_str(), manifest_path().c_str());
+}
+
+// Учитывает в манифесте строки, дописанные в сегмент; сохраняет манифест вызывающий
+void manifest_append(int segment, int rows, long long bytes) {
+    if (segment > (int)segment_rows.size()) {
+        segment_rows.push_back(0);
+        segment_bytes.push_back(0);
+        segment_dead.push_back(0);
+    }
+    segment_rows[segment - 1] += rows;
+    segment_bytes[segment - 1] += bytes;
+}
+
+string index_path(const string& column) const {
+    return table_path + "/" + column + ".idx";
+}
+
+// Находит файлы *.idx в каталоге таблицы; если манифест исправлялся, индексы строятся заново
+void load_indexes(bool rebuild) {
+    DIR* dir = opendir(table_path.c_str());
+    if (!dir) {
+        return;
+    }
+    vector<string> files;
+    while (struct dirent* item = readdir(dir)) {
+        string name = item->d_name;
+        if (name.size() > 4 && name.compare(name.size() - 4, 4, ".idx") == 0) {
+            files.push_back(name);
+        }
+    }
+    closedir(dir);
+    sort(files.begin(), files.end());
+
+    for (const string& name : files) {
+        ColumnIndex index;
+        int removals = 0;
+        bool loaded = index.load(table_path + "/" + name, removals);
+        index.col_index = get_column_ind(index.column);
+        if (!loaded || index.col_index == -1) {
+            cerr << "Индекс " << name << " таблицы " << table_name << " поврежден и пропущен" << endl;
+            continue;
+        }
+        if (rebuild) {
+            build_index(index);
+            index.save(index_path(index.column));
+        } else if (removals > 0 && removals >= (int)(index.hash.size() + index.tree.size())) {
+            index.save(index_path(index.column));  // Убираем из файла накопившиеся строки удаления
+        }
+        indexes.push_back(index);
+    }
+}
+
+// Заполняет индекс по всем строкам таблицы; сегменты читаются параллельно
+void build_index(ColumnIndex& index) {
+    index.hash.clear();
+    index.tree.clear();
+    vector<vector<pair<string, int>>> keys(segment_rows.size());
+    scan_rows([&](int segment, const RowFields& fields) {
+        long long pk;
+        if (index.col_index < (int)fields.fields.size() && WhereCond::parse_number(fields.fields[0], pk)) {
+            string key;
+            WhereCond::cell_key(fields.fields[index.col_index], key);
+            keys[segment].push_back({key, (int)pk});
+        }
+    });
+    for (size_t segment = 0; segment < keys.size(); ++segment) {
+        for (const pair<string, int>& key : keys[segment]) {
+            index.add(key.first, {(int)segment + 1, key.second});
+        }
+    }
+}
+
+void create_index(const string& column, bool ordered, ostream& out) {
+    table_lock.tableLock();  // Блокируем таблицу
+
+    ColumnIndex index;
+    index.column = column;
+    index.col_index = get_column_ind(column);
+    index.ordered = ordered;
+    size_t dot = column.find('.');
+    if (dot != string::npos) {
+        index.column = column.substr(dot + 1);  // Файл индекса называется по колонке без имени таблицы
+    }
+
+    bool exists = false;
+    for (const ColumnIndex& existing : indexes) {
+        exists = exists || existing.col_index == index.col_index;
+    }
+
+    if (index.col_index <= 0) {
+        cerr << "Столбец не найден " << column << endl;
+    } else if (exists) {
+        cerr << "Индекс по колонке " << index.column << " уже существует" << endl;
+    } else {
+        build_index(index);
+        index.save(index_path(index.column));
+        indexes.push_back(index);
+        out << "Индекс по колонке " << index.column << " таблицы " << table_name << " создан" << endl;
+    }
+
+    table_lock.tableUnlock();  // Разблокируем таблицу
+}
+
+// Сегменты, которые могут содержать строки условия, по вторичным индексам.
+// false — индекс неприменим хотя бы к одной OR-группе, нужен полный просмотр.
+bool index_candidates(const WherePredicate& predicate, vector<int>& segments) const {
+    if (indexes.empty() || !predicate.valid || predicate.any_of.empty()) {
+        return false;
+    }
+    vector<char> marked(segment_rows.size(), 0);
+    for (const vector<WhereCond>& all_of : predicate.any_of) {
+        bool used = false;
+        for (size_t i = 0; i < all_of.size() && !used; ++i) {
+            for (const ColumnIndex& index : indexes) {
+                if (index.lookup(all_of[i], marked)) {
+                    used = true;
+                    break;
+                }
+            }
+        }
+        if (!used) {
+            return false;
+        }
+    }
+    segments.clear();
+    for (size_t i = 0; i < marked.size(); ++i) {
+        if (marked[i]) {
+            segments.push_back(i);
+        }
+    }
+    return true;
+}
+
+string pk_index_path() const {
+    return table_path + "/" + table_name + "_pk_index";
+}
+
+// Запись файла индекса первичного ключа: три 32-битных числа pk, сегмент, смещение (сегмент 0 — удаление)
+static void append_pk_record(string& out, int pk, RowLocation location) {
+    int32_t record[3] = {pk, location.segment, (int32_t)location.offset};
+    out.append(reinterpret_cast<const char*>(record), sizeof(record));
+}
+
+void set_pk_location(int pk, RowLocation location) {
+    if (pk < 0) {
+        return;
+    }
+    if (pk >= (int)pk_locations.size()) {
+        pk_locations.resize(max((size_t)pk + 1, pk_locations.size() * 2), RowLocation{0, 0});
+    }
+    pk_locations[pk] = location;
+}
+
+RowLocation find_pk(long long pk) const {
+    if (pk < 0 || pk >= (long long)pk_locations.size()) {
+        return RowLocation{0, 0};
+    }
+    return pk_locations[pk];
+}
+
+// Журнал положений строк проигрывается целиком; без файла или после исправления манифеста индекс строится заново
+void load_pk_index(bool rebuild) {
+    pk_locations.clear();
+    int fd = rebuild ? -1 : open(pk_index_path().c_str(), O_RDONLY);
+    if (fd < 0) {
+        rebuild_pk_index();
+        return;
+    }
+
+    int max_pk = 0;
+    size_t records = 0;
+    size_t live = 0;
+    int32_t record[3];
+    while (read(fd, record, sizeof(record)) == (ssize_t)sizeof(record)) {
+        RowLocation previous = find_pk(record[0]);
+        set_pk_location(record[0], RowLocation{record[1], (unsigned)record[2]});
+        live += (record[1] != 0) - (previous.segment != 0);
+        max_pk = max(max_pk, record[0]);
+        records++;
+    }
+    close(fd);
+
+    pk_sequence = max(pk_sequence, max_pk + 1);
+    if (records > 2 * live + 1024) {
+        save_pk_index();  // Журнал вырос из-за удалений и перемещений — сохраняем снимок
+    }
+}
+
+void rebuild_pk_index() {
+    pk_locations.clear();
+    vector<vector<pair<int, unsigned>>> found(segment_rows.size());
+    scan_rows([&](int segment, const RowFields& fields) {
+        long long pk;
+        if (WhereCond::parse_number(fields.fields[0], pk)) {
+            found[segment].push_back({(int)pk, (unsigned)fields.offset});
+        }
+    });
+    for (size_t segment = 0; segment < found.size(); ++segment) {
+        for (const pair<int, unsigned>& row : found[segment]) {
+            set_pk_location(row.first, RowLocation{(int)segment + 1, row.second});
+            pk_sequence = max(pk_sequence, row.first + 1);
+        }
+    }
+    save_pk_index();
+}
+
+// Снимок индекса первичного ключа: только живые строки, через временный файл
+void save_pk_index() {
+    string out;
+    for (size_t pk = 0; pk < pk_locations.size(); ++pk) {
+        if (pk_locations[pk].segment != 0) {
+            append_pk_record(out, pk, pk_locations[pk]);
+        }
+    }
+    string temp_path = pk_index_path() + ".tmp";
+    unlink(temp_path.c_str());
+    append_to_file(temp_path, out);
+    rename(temp_path.c_str(), pk_index_path().c_str());
+}
+
+// Читает строку по смещению через pread; false, если строки нет или она удалена
+bool read_row_at(RowLocation location, string& line, ScanStats& stats) const {
+    line.clear();
+    if (SegmentCache::budget > 0 && location.segment <= (int)segment_rows.size()) {
+        shared_ptr<const CachedSegment> cached = SegmentCache::instance().find(
+            SegmentCache::key(cache_id, location.segment), segment_bytes[location.segment - 1], segment_dead[location.segment - 1], false);
+        if (cached) {
+            stats.segments++;
+            stats.cached++;
+            stats.rows++;
+            size_t r;
+            if (!cached->find_row(location.offset, r)) {
+                return false;  // Строка удалена
+            }
+            RowFields fields;
+            cached->row(r, fields);
+            line.assign(fields.line, fields.line_len);
+            return true;
+        }
+    }
+    int fd = open(segment_path(location.segment).c_str(), O_RDONLY);
+    if (fd < 0) {
+        return false;
+    }
+    stats.segments++;
+    stats.rows++;
+    char buffer[4096];
+    off_t pos = location.offset;
+    while (true) {
+        ssize_t n = pread(fd, buffer, sizeof(buffer), pos);
+        if (n <= 0) {
+            break;
+        }
+        stats.bytes += n;
+        const char* newline = static_cast<const char*>(memchr(buffer, '\n', n));
+        if (newline) {
+            line.append(buffer, newline - buffer);
+            break;
+        }
+        line.append(buffer, n);
+        pos += n;
+    }
+    close(fd);
+    return !line.empty() && line[0] != SegmentReader::TOMBSTONE;
+}
+
+// Первичные ключи, которыми исчерпываются строки условия: равенство по <table>_pk или по колонке
+// с вторичным индексом в каждой OR-группе. false — точечный доступ неприменим.
+bool pk_candidates(const WherePredicate& predicate, vector<int>& pks) const {
+    if (!predicate.valid || predicate.any_of.empty()) {
+        return false;
+    }
+    pks.clear();
+    for (const vector<WhereCond>& all_of : predicate.any_of) {
+        bool used = false;
+        for (size_t i = 0; i < all_of.size() && !used; ++i) {
+            const WhereCond& cond = all_of[i];
+            if (cond.col_index == 0 && cond.op == OP_EQ && cond.rhs_slot < 0) {
+                if (cond.is_number) {
+                    pks.push_back(cond.number);
+                }
+                used = true;
+            }
+            for (size_t k = 0; k < indexes.size() && !used; ++k) {
+                used = indexes[k].lookup_pks(cond, pks);
+            }
+        }
+        if (!used) {
+            return false;
+        }
+    }
+    sort(pks.begin(), pks.end());
+    pks.erase(unique(pks.begin(), pks.end()), pks.end());
+    return true;
+}
+
+int get_row_count(const string& file, int* dead = nullptr) {
+    SegmentReader reader;
+    reader.open(file);
+    return reader.count_rows(dead);  // Заголовок не считается строкой данных
+}
+
+// Резервирует диапазон первичных ключей одной записью в файл; возвращает первый ключ диапазона
+int reserve_pk(int count) {
+    int first_pk = pk_sequence;
+    pk_sequence += count;
+    // Записываем новое значение в файл
+    ofstream pk_file(table_path + "/" + table_name + "_pk_sequence");
+    pk_file << pk_sequence;
+    pk_file.close();
+    return first_pk;
+}
+
+string header_line() const {
+    string header = table_name + "_pk,";  // Первичный ключ
+    for (int i = 0; i < columns_count; ++i) {
+        header += columns[i];  // Имена колонок
+        if (i != columns_count - 1) {
+            header += ",";  // Добавляем запятую, если это не последняя колонка
+        }
+    }
+    return header + "\n";
+}
+
+static void append_row(string& out, int pk, const vector<string>& values) {
+    out += to_string(pk);  // Первичный ключ
+    for (const string& value : values) {
+        out += ",";
+        out += value;  // Значения колонок
+    }
+    out += "\n";
+}
+
+bool append_to_segment(int segment, const string& data) {
+    return append_to_file(segment_path(segment), data);
+}
+
+// Дописывает буфер в файл одним системным вызовом write (повторяя его только при частичной записи)
+static bool append_to_file(const string& file_path, const string& data) {
+    int fd = open(file_path.c_str(), O_WRONLY | O_CREAT | O_APPEND, 0644);
+    if (fd < 0) {
+        cerr << "Ошибка: Не удалось открыть файл " << file_path << endl;
+        return false;
+    }
+    size_t written = 0;
+    while (written < data.size()) {
+        ssize_t n = write(fd, data.data() + written, data.size() - written);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n < 0) {
+            cerr << "Ошибка записи в файл " << file_path << ": " << strerror(errno) << endl;
+            close(fd);
+            return false;
+        }
+        written += n;
+    }
+    close(fd);
+    return true;
+}
+
+bool insRow(const vector<string>& values) {
+    return insBatch(vector<vector<string>>{values}) == 1;
+}
+
+// Пакетная вставка: одна блокировка, один резерв диапазона PK, одна запись в журнал
+// и одна запись на каждый затронутый сегмент. Возвращает число записанных строк.
+// Запись журнала верна только для строк, которые записал write_rows: ключи недописанных строк
+// сразу журналируются как удаленные, и при проигрывании они не появятся
+int insBatch(const vector<vector<string>>& rows) {
+    if (rows.empty()) {
+        return 0;
+    }
+    table_lock.tableLock();  // Блокируем таблицу
+    if (wal) {
+        wal->begin_change();
+    }
+
+    int pk = reserve_pk(rows.size());
+    vector<string> lines(rows.size());  // Строки сегмента без перевода строки, с первичным ключом
+    string record = "I " + table_name + "\n";  // Запись журнала: заголовок и сами строки
+    for (size_t i = 0; i < rows.size(); ++i) {
+        append_row(lines[i], pk + i, rows[i]);
+        record += lines[i];
+        lines[i].pop_back();
+    }
+    if (wal) {
+        long long end = wal->append(record);
+        if (end < 0) {  // Без записи в журнале сегменты не меняются
+            wal->end_change();
+            table_lock.tableUnlock();
+            return 0;
+        }
+        wal->commit(end);
+    }
+    int inserted = write_rows(lines);
+    if (wal && inserted < (int)rows.size()) {
+        vector<int> unwritten;
+        for (size_t i = inserted; i < rows.size(); ++i) {
+            unwritten.push_back(pk + i);
+        }
+        if (!log_delete(unwritten)) {
+            cerr << "Ошибка: недописанные строки таблицы " << table_name << " могут появиться при восстановлении" << endl;
+        }
+    }
+
+    if (wal) {
+        wal->end_change();
+    }
+    table_lock.tableUnlock();  // Разблокируем таблицу
+    return inserted;
+}
+
+// Дописывает готовые строки в хвостовые сегменты и обновляет манифест, индекс первичного ключа и вторичные индексы.
+// Индексы получают строки сегмента только после успешной записи в него. Возвращает число записанных строк:
+// меньше lines.size(), если запись в сегмент не удалась
+int write_rows(const vector<string>& lines) {
+    vector<string> index_out(indexes.size());  // Новые записи индексов, дописываются одной записью на индекс
+    string pk_out;  // Новые записи индекса первичного ключа
+    string key;
+    RowFields fields;
+    vector<int> touched;  // Сегменты (с нуля), в которые дописаны строки
+    int total = 0;
+    size_t next = 0;
+    while (next < lines.size()) {
+        int segment = get_next_segment();  // Хвостовой сегмент из манифеста
+        bool is_empty = segment > (int)segment_rows.size() || segment_bytes[segment - 1] == 0;
+        int used = segment > (int)segment_rows.size() ? 0 : segment_rows[segment - 1];
+        int free_rows = max(1, tuples_limit - used);
+
+        string out;
+        if (is_empty) {  // Если файл пустой, записываем заголовок
+            out = header_line();
+        }
+        long long base = is_empty ? 0 : segment_bytes[segment - 1];  // Смещение начала буфера в сегменте
+        size_t first = next;
+        vector<unsigned> offsets;  // Смещения строк буфера в сегменте
+        for (; next < lines.size() && (int)offsets.size() < free_rows; ++next) {
+            offsets.push_back(base + out.size());
+            out += lines[next];
+            out += "\n";
+        }
+
+        uncache(segment);
+        if (!append_to_segment(segment, out)) {
+            truncate(segment_path(segment).c_str(), base);  // Частично дописанные строки отрезаются
+            break;
+        }
+        for (size_t r = 0; r < offsets.size(); ++r) {
+            const string& line = lines[first + r];
+            int pk = atoi(line.c_str());
+            RowLocation location{segment, offsets[r]};
+            append_pk_record(pk_out, pk, location);
+            set_pk_location(pk, location);
+            if (!indexes.empty()) {
+                fields.split(line);
+            }
+            for (size_t k = 0; k < indexes.size(); ++k) {
+                FieldSpan value{"", 0};
+                if (indexes[k].col_index < (int)fields.fields.size()) {
+                    value = fields.fields[indexes[k].col_index];
+                }
+                WhereCond::cell_key(value, key);
+                indexes[k].add(key, IndexEntry{segment, pk});
+                ColumnIndex::append_line(index_out[k], key, IndexEntry{segment, pk});
+            }
+        }
+        manifest_append(segment, offsets.size(), out.size());
+        touched.push_back(segment - 1);
+        total += offsets.size();
+    }
+    save_manifest();
+    append_index_changes(pk_out, index_out);
+    refresh_zones(touched);  // Карты и копии получают только сегменты, заполненные этой вставкой
+    if (columnar) {
+        refresh_columnar(touched);
+    }
+    return total;
+}
+
+// Разбирает строку файла COPY: значения без пробелов и кавычек дописываются в out через запятую.
+// Запятая внутри кавычек — ошибка: в сегменте ячейки разделяются только запятыми
+bool parse_copy_line(const char* line, size_t len, string& out, string& error) const {
+    int fields = 1;
+    bool quoted = false;
+    for (size_t i = 0; i < len; ++i) {
+        char c = line[i];
+        if (c == '"') {
+            quoted = !quoted;  // Удвоенная кавычка внутри значения просто удаляется
+        } else if (c == ',') {
+            if (quoted) {
+                error = "запятая внутри значения";
+                return false;
+            }
+            fields++;
+            out += ',';
+        } else if (c != ' ' && c != '\r') {
+            out += c;
+        }
+    }
+    if (quoted) {
+        error = "незакрытая кавычка";
+        return false;
+    }
+    if (fields != columns_count) {
+        error = "значений " + to_string(fields) + ", ожидалось " + to_string(columns_count);
+        return false;
+    }
+    return true;
+}
+
+// COPY t FROM 'file.csv': файл отображается в память и проверяется параллельно по кускам,
+// ключи резервируются одним диапазоном, а строки пишутся волнами целых сегментов мимо журнала.
+// Ошибка в любой строке отменяет загрузку до записи; возвращает число загруженных строк
+long long copy_from(const string& file_path, bool header, ostream& out) {
+    SegmentReader source;
+    if (!source.open(file_path)) {
+        cerr << "Ошибка: Не удалось открыть файл " << file_path << ": " << strerror(errno) << endl;
+        return -1;
+    }
+    auto started = chrono::steady_clock::now();
+    const char* data = source.data;
+    size_t size = source.size;
+    size_t begin = 0;
+    if (header) {
+        const char* end = size ? static_cast<const char*>(memchr(data, '\n', size)) : nullptr;
+        begin = end ? end - data + 1 : size;
+    }
+
+    // Первый проход: куски по границам строк, в каждом — проверка строк и начала непустых строк
+    struct CopyChunk {
+        size_t begin, end;
+        vector<size_t> starts;
+        size_t error_at = SIZE_MAX;  // Смещение первой ошибочной строки куска
+        string error;
+    };
+    WorkerPool& pool = WorkerPool::instance();
+    size_t chunk_bytes = max<size_t>(1 << 20, (size - begin) / ((pool.threads.size() + 1) * 4) + 1);
+    vector<CopyChunk> chunks;
+    while (begin < size) {
+        size_t end = min(size, begin + chunk_bytes);
+        const char* newline = end < size ? static_cast<const char*>(memchr(data + end, '\n', size - end)) : nullptr;
+        end = newline ? newline - data + 1 : size;
+        chunks.push_back(CopyChunk{begin, end, {}, SIZE_MAX, string()});
+        begin = end;
+    }
+    pool.run(chunks.size(), [&](int task) {
+        CopyChunk& chunk = chunks[task];
+        string scratch;
+        for (size_t pos = chunk.begin; pos < chunk.end;) {
+            const char* newline = static_cast<const char*>(memchr(data + pos, '\n', chunk.end - pos));
+            size_t len = (newline ? newline - data : chunk.end) - pos;
+            if (len > 0 && !(len == 1 && data[pos] == '\r')) {  // Пустые строки пропускаются
+                scratch.clear();
+                if (!parse_copy_line(data + pos, len, scratch, chunk.error)) {
+                    chunk.error_at = pos;
+                    return;
+                }
+                chunk.starts.push_back(pos);
+            }
+            pos += len + 1;
+        }
+    });
+
+    vector<size_t> starts;  // Начала строк данных в файле, по порядку
+    for (const CopyChunk& chunk : chunks) {
+        if (chunk.error_at != SIZE_MAX) {
+            long long line = count(data, data + chunk.error_at, '\n') + 1;
+            cerr << "Ошибка COPY в строке " << line << " файла " << file_path << ": " << chunk.error << ". Ничего не загружено" << endl;
+            return -1;
+        }
+        starts.insert(starts.end(), chunk.starts.begin(), chunk.starts.end());
+    }
+    chunks.clear();
+
+    table_lock.tableLock();
+    int first_pk = reserve_pk(starts.size());  // Один диапазон ключей на весь файл
+    table_lock.tableUnlock();
+
+    // Второй проход: волна — по сегменту на поток; каждый сегмент строится и пишется своим потоком,
+    // манифест и индексы обновляются одной записью на волну
+    struct CopySegment {
+        int segment;
+        size_t first, count;  // Строки файла starts[first, first + count)
+        bool is_empty;
+        long long base;  // Смещение первой строки буфера в сегменте
+        string data;
+        string pk_out;
+        vector<unsigned> offsets;
+        vector<vector<string>> keys;  // Ключи вторичных индексов по строкам
+        vector<string> index_out;
+        bool written = false;
+    };
+    size_t wave_segments = 2 * (pool.threads.size() + 1);
+    size_t next = 0;
+    long long loaded = 0;
+    int segments_written = 0;
+    while (next < starts.size()) {
+        table_lock.tableLock();
+        if (wal) {
+            wal->begin_change();  // Контрольная точка не застанет волну наполовину записанной
+        }
+
+        vector<CopySegment> wave;
+        int segment = get_next_segment();
+        while (wave.size() < wave_segments && next < starts.size()) {
+            bool exists = segment <= (int)segment_rows.size();
+            int used = exists ? segment_rows[segment - 1] : 0;
+            size_t count = min<size_t>(max(1, tuples_limit - used), starts.size() - next);
+            wave.push_back(CopySegment{segment, next, count, !exists || segment_bytes[segment - 1] == 0,
+                                       exists ? segment_bytes[segment - 1] : 0, string(), string(), {}, {}, {}, false});
+            next += count;
+            segment++;
+        }
+
+        pool.run(wave.size(), [&](int task) {
+            CopySegment& part = wave[task];
+            if (part.is_empty) {
+                part.data = header_line();
+                part.base = 0;
+            }
+            part.keys.resize(indexes.size());
+            part.index_out.resize(indexes.size());
+            RowFields fields;
+            string key, error;
+            for (size_t r = part.first; r < part.first + part.count; ++r) {
+                int pk = first_pk + r;
+                unsigned offset = part.base + part.data.size();
+                part.offsets.push_back(offset);
+                append_pk_record(part.pk_out, pk, RowLocation{part.segment, offset});
+                size_t row_begin = part.data.size();
+                part.data += to_string(pk);
+                part.data += ',';
+                const char* newline = static_cast<const char*>(memchr(data + starts[r], '\n', size - starts[r]));
+                size_t len = (newline ? newline - data : size) - starts[r];
+                parse_copy_line(data + starts[r], len, part.data, error);  // Строка уже проверена первым проходом
+                if (!indexes.empty()) {
+                    fields.split(part.data.data() + row_begin, part.data.size() - row_begin);
+                }
+                for (size_t k = 0; k < indexes.size(); ++k) {
+                    WhereCond::cell_key(fields.fields[indexes[k].col_index], key);
+                    ColumnIndex::append_line(part.index_out[k], key, IndexEntry{part.segment, pk});
+                    part.keys[k].push_back(key);
+                }
+                part.data += '\n';
+            }
+            part.written = append_to_segment(part.segment, part.data);
+        });
+
+        string pk_out;
+        vector<string> index_out(indexes.size());
+        vector<int> touched;
+        bool failed = false;
+        for (CopySegment& part : wave) {
+            if (failed || !part.written) {
+                if (!failed) {
+                    cerr << "Ошибка COPY: не удалось записать сегмент " << part.segment << ", загрузка прервана" << endl;
+                }
+                if (failed && part.written && part.is_empty) {
+                    unlink(segment_path(part.segment).c_str());  // Сегмент за неудачным в манифест не попадет
+                }
+                failed = true;
+                continue;
+            }
+            uncache(part.segment);
+            manifest_append(part.segment, part.count, part.data.size());
+            touched.push_back(part.segment - 1);
+            pk_out += part.pk_out;
+            for (size_t r = 0; r < part.count; ++r) {
+                int pk = first_pk + part.first + r;
+                set_pk_location(pk, RowLocation{part.segment, part.offsets[r]});
+                for (size_t k = 0; k < indexes.size(); ++k) {
+                    indexes[k].add(part.keys[k][r], IndexEntry{part.segment, pk});
+                }
+            }
+            for (size_t k = 0; k < indexes.size(); ++k) {
+                index_out[k] += part.index_out[k];
+            }
+            loaded += part.count;
+            segments_written++;
+        }
+        save_manifest();
+        append_index_changes(pk_out, index_out);
+        refresh_zones(touched);
+        if (columnar) {
+            refresh_columnar(touched);
+        }
+
+        if (wal) {
+            wal->end_change();
+        }
+        table_lock.tableUnlock();
+        if (failed) {
+            break;
+        }
+    }
+
+    double seconds = chrono::duration<double>(chrono::steady_clock::now() - started).count();
+    out << "Загружено строк в таблицу " << table_name << ": " << loaded << " (сегментов: " << segments_written << ", "
+        << (long long)(seconds > 0 ? loaded / seconds : loaded) << " строк/с)" << endl;
+    return loaded;
+}
+
+// Журналирует удаление строк с перечисленными ключами до изменения сегментов; false — запись в журнал не удалась
+bool log_delete(const vector<int>& pks) {
+    if (!wal || pks.empty()) {
+        return true;
+    }
+    string record = "D " + table_name + "\n";
+    for (int pk : pks) {
+        record += to_string(pk);
+        record += "\n";
+    }
+    long long end = wal->append(record);
+    if (end < 0) {
+        return false;
+    }
+    wal->commit(end);
+    return true;
+}
+
+// Отрезает от сегмента недописанную при сбое последнюю строку
+void truncate_torn_tail(int segment) {
+    int fd = open(segment_path(segment).c_str(), O_RDWR);
+    if (fd < 0) {
+        return;
+    }
+    struct stat st;
+    fstat(fd, &st);
+    off_t end = st.st_size;
+    char buffer[4096];
+    while (end > 0) {
+        off_t start = max((off_t)0, end - (off_t)sizeof(buffer));
+        ssize_t n = pread(fd, buffer, end - start, start);
+        if (n <= 0) {
+            break;
+        }
+        const char* newline = static_cast<const char*>(memrchr(buffer, '\n', n));
+        if (newline) {
+            end = start + (newline - buffer) + 1;
+            break;
+        }
+        end = start;
+    }
+    if (end < st.st_size) {
+        cerr << "Сегмент " << segment_path(segment) << ": отрезана недописанная строка" << endl;
+        ftruncate(fd, end);
+    }
+    close(fd);
+}
+
+// Восстановление после сбоя: производные файлы таблицы строятся заново по сегментам,
+// после чего записи журнала проигрываются поверх них
+void recover() {
+    struct stat st;
+    for (int segment = 1; stat(segment_path(segment).c_str(), &st) == 0; ++segment) {
+        truncate_torn_tail(segment);
+    }
+    rebuild_manifest();
+    rebuild_pk_index();
+    for (ColumnIndex& index : indexes) {
+        build_index(index);
+        index.save(index_path(index.column));
+    }
+    load_columnar();
+    load_zones();
+}
+
+// Проигрывание записи журнала: строки, ключи которых уже есть в сегментах или удаляются дальше по журналу,
+// повторно не вставляются, а удаление по списку ключей можно повторять сколько угодно раз
+void replay(char kind, const string& body, const unordered_set<int>& deleted_later) {
+    vector<string> lines;
+    istringstream records(body);
+    string line;
+    while (getline(records, line)) {
+        if (line.empty()) {
+            continue;
+        }
+        int pk = atoi(line.c_str());
+        pk_sequence = max(pk_sequence, pk + 1);
+        if (kind == 'D' || (find_pk(pk).segment == 0 && !deleted_later.count(pk))) {
+            lines.push_back(line);
+        }
+    }
+
+    if (kind == 'I') {
+        write_rows(lines);
+    } else {
+        vector<int> pks;
+        for (const string& pk : lines) {
+            pks.push_back(atoi(pk.c_str()));
+        }
+        delete_by_pk(WherePredicate(), pks);
+    }
+    reserve_pk(0);  // Сохраняем счетчик первичного ключа
+}
+
+// predicate уже разобран планом запроса; condition — его текст для сообщения
+void delRow(const WherePredicate& predicate, const string& condition, ostream& out) {
+    table_lock.tableLock();  // Блокируем таблицу
+    if (wal) {
+        wal->begin_change();
+    }
+
+    out << "Удаление из таблицы: " << table_name << " с условием: '" << condition << "'" << endl;
+
+    vector<int> pks;
+    int deleted_rows = pk_candidates(predicate, pks) ? delete_by_pk(predicate, pks) : delete_by_rewrite(predicate);
+    out << "Удалено строк: " << deleted_rows << endl;
+
+    if (wal) {
+        wal->end_change();
+    }
+    table_lock.tableUnlock();  // Разблокируем таблицу
+}
+
+// Ключи вторичных индексов для строки, в порядке indexes
+vector<string> index_keys(const RowFields& fields) const {
+    vector<string> keys(indexes.size());
+    for (size_t k = 0; k < indexes.size(); ++k) {
+        if (indexes[k].col_index < (int)fields.fields.size()) {
+            WhereCond::cell_key(fields.fields[indexes[k].col_index], keys[k]);
+        }
+    }
+    return keys;
+}
+
+// Убирает удаленную строку из индексов; записи для файлов индексов копятся в pk_out и index_out
+void unindex_row(int pk, int segment, const vector<string>& keys, string& pk_out, vector<string>& index_out) {
+    set_pk_location(pk, RowLocation{0, 0});
+    append_pk_record(pk_out, pk, RowLocation{0, 0});
+    for (size_t k = 0; k < indexes.size(); ++k) {
+        indexes[k].remove_entry(keys[k], pk);
+        ColumnIndex::append_removal(index_out[k], keys[k], IndexEntry{segment, pk});
+    }
+}
+
+void append_index_changes(const string& pk_out, const vector<string>& index_out) {
+    append_to_file(pk_index_path(), pk_out);
+    for (size_t k = 0; k < indexes.size(); ++k) {
+        append_to_file(index_path(indexes[k].column), index_out[k]);
+    }
+}
+
+// Удаление по известным первичным ключам: строка читается по смещению и помечается TOMBSTONE на месте,
+// сегмент не переписывается
+int delete_by_pk(const WherePredicate& predicate, const vector<int>& pks) {
+    string line;
+    RowFields fields;
+    vector<int> victims;  // Ключи подходящих строк: сначала журналируются, потом помечаются в сегментах
+    vector<RowLocation> locations;
+    vector<vector<string>> keys;
+
+    ScanStats stats;
+    for (int pk : pks) {
+        RowLocation location = find_pk(pk);
+        if (location.segment == 0 || !read_row_at(location, line, stats)) {
+            continue;
+        }
+        fields.split(line);
+        if (!predicate.matches(fields)) {
+            continue;
+        }
+        victims.push_back(pk);
+        locations.push_back(location);
+        keys.push_back(index_keys(fields));
+    }
+    stats.collect_predicates();
+    record_scan(stats);
+    if (!log_delete(victims)) {
+        return 0;  // Сегменты не тронуты
+    }
+
+    string pk_out;
+    vector<string> index_out(indexes.size());
+    int deleted_rows = 0;
+    for (size_t i = 0; i < victims.size(); ++i) {
+        RowLocation location = locations[i];
+        int fd = open(segment_path(location.segment).c_str(), O_WRONLY);
+        bool marked = fd >= 0 && pwrite(fd, &SegmentReader::TOMBSTONE, 1, location.offset) == 1;
+        if (fd >= 0) {
+            close(fd);
+        }
+        if (!marked) {
+            cerr << "Ошибка записи в файл " << segment_path(location.segment) << endl;
+            continue;
+        }
+
+        unindex_row(victims[i], location.segment, keys[i], pk_out, index_out);
+        segment_dead[location.segment - 1]++;
+        uncache(location.segment);
+        deleted_rows++;
+    }
+
+    if (deleted_rows > 0) {
+        save_manifest();
+        append_index_changes(pk_out, index_out);
+        if (columnar) {
+            vector<int> touched;
+            for (RowLocation location : locations) {
+                touched.push_back(location.segment - 1);
+            }
+            sort(touched.begin(), touched.end());
+            touched.erase(unique(touched.begin(), touched.end()), touched.end());
+            refresh_columnar(touched);
+        }
+    }
+    return deleted_rows;
+}
+
+// Удаление по произвольному условию: сегменты с подходящими строками переписываются параллельно
+int delete_by_rewrite(const WherePredicate& predicate) {
+    int segments = segment_rows.size();
+    vector<int> kept_rows(segments, -1);  // -1 — в сегменте нет подходящих строк, файл не переписывается
+    vector<long long> kept_bytes(segments, 0);
+    vector<vector<pair<int, vector<string>>>> removed_keys(segments);  // pk и ключи индексов удаленных строк
+    vector<vector<pair<int, unsigned>>> moved(segments);  // Новые смещения оставшихся строк
+    vector<string> kept_data(segments);  // Новое содержимое переписываемых сегментов
+
+    vector<int> candidates;  // По индексу просматриваются только сегменты, где могут быть подходящие строки
+    if (!index_candidates(predicate, candidates)) {
+        for (int i = 0; i < segments; ++i) {
+            candidates.push_back(i);
+        }
+    }
+
+    // Каждый сегмент обрабатывается отдельной задачей и переписывается, только если из него что-то удалено.
+    // Сначала считается новое содержимое, затем удаление журналируется, и только после этого сегменты подменяются.
+    WorkerPool::instance().run(candidates.size(), [&](int task) {
+        int i = candidates[task];
+        if (zone_excludes(i, predicate)) {
+            return;  // Сегмент не переписывается
+        }
+        string file_path = segment_path(i + 1);
+        SegmentReader reader;
+        reader.open(file_path);  // Отображаем сегмент в память
+        string kept;  // Содержимое сегмента после удаления
+        RowFields fields;
+        int rows = 0;
+        bool deleted = false;
+
+        const char* header;
+        size_t header_len;
+        if (reader.next_line(header, header_len)) {  // Читаем заголовок таблицы
+            kept.append(header, header_len);
+            kept += "\n";
+        }
+
+        ScanStats stats;
+        stats.segments = 1;
+        stats.bytes = reader.size;
+        while (reader.next_row(fields)) {
+            stats.rows++;
+            long long pk = 0;
+            WhereCond::parse_number(fields.fields[0], pk);
+            if (predicate.matches(fields)) {
+                deleted = true;
+                removed_keys[i].push_back({(int)pk, index_keys(fields)});
+            } else {
+                moved[i].push_back({(int)pk, (unsigned)kept.size()});
+                kept.append(fields.line, fields.line_len);
+                kept += "\n";
+                rows++;
+            }
+        }
+        stats.collect_predicates();
+        record_scan(stats);
+
+        // Строки, помеченные удаленными, при перезаписи тоже отбрасываются
+        if (!deleted && segment_dead[i] == 0) {
+            return;
+        }
+
+        kept_rows[i] = rows;
+        kept_bytes[i] = kept.size();
+        kept_data[i].swap(kept);
+    });
+
+    vector<int> victims;
+    vector<int> rewritten;
+    for (int i = 0; i < segments; ++i) {
+        if (kept_rows[i] >= 0) {
+            rewritten.push_back(i);
+            for (const pair<int, vector<string>>& removed : removed_keys[i]) {
+                victims.push_back(removed.first);
+            }
+        }
+    }
+    if (!log_delete(victims)) {
+        return 0;
+    }
+
+    bool durable = wal && wal->policy != FSYNC_OS;
+    vector<char> replaced(segments, 0);  // Сегмент подменен новым файлом; иначе учет по нему не меняется
+    WorkerPool::instance().run(rewritten.size(), [&](int task) {
+        int i = rewritten[task];
+        string temp_file_path = table_path + "/temp" + to_string(i + 1) + ".csv";  // Временный файл для записи данных
+        unlink(temp_file_path.c_str());
+        bool saved = append_to_file(temp_file_path, kept_data[i]);
+        if (saved && durable) {
+            // Старые строки сегмента в журнале уже не записаны: новый файл должен быть на диске до подмены
+            int fd = open(temp_file_path.c_str(), O_RDONLY);
+            saved = fd >= 0 && fdatasync(fd) == 0;
+            if (fd >= 0) {
+                close(fd);
+            }
+        }
+        if (saved) {
+            saved = rename(temp_file_path.c_str(), segment_path(i + 1).c_str()) == 0;  // rename атомарно заменяет сегмент
+        }
+        if (!saved) {
+            unlink(temp_file_path.c_str());
+        }
+        replaced[i] = saved;
+        string().swap(kept_data[i]);
+    });
+
+    int deleted_rows = 0;
+    string pk_out;
+    vector<string> index_out(indexes.size());
+    vector<int> refreshed;
+    for (int i = 0; i < segments; ++i) {
+        if (kept_rows[i] < 0) {
+            continue;
+        }
+        if (!replaced[i]) {
+            cerr << "Ошибка: сегмент " << segment_path(i + 1) << " не переписан, строки из него не удалены" << endl;
+            continue;
+        }
+        refreshed.push_back(i);
+        deleted_rows += removed_keys[i].size();
+        uncache(i + 1);
+        segment_rows[i] = kept_rows[i];
+        segment_bytes[i] = kept_bytes[i];
+        segment_dead[i] = 0;
+        for (const pair<int, unsigned>& row : moved[i]) {
+            set_pk_location(row.first, RowLocation{i + 1, row.second});
+            append_pk_record(pk_out, row.first, RowLocation{i + 1, row.second});
+        }
+        for (const pair<int, vector<string>>& removed : removed_keys[i]) {
+            unindex_row(removed.first, i + 1, removed.second, pk_out, index_out);
+        }
+    }
+    if (!pk_out.empty()) {
+        save_manifest();
+        append_index_changes(pk_out, index_out);
+    }
+    refresh_zones(refreshed);
+    if (columnar) {
+        refresh_columnar(refreshed);
+    }
+    return deleted_rows;
+}
+
+string compaction_path() const {
+    return table_path + "/" + table_name + "_compact";
+}
+
+string compaction_temp_path(int segment) const {
+    return table_path + "/compact" + to_string(segment) + ".csv";
+}
+
+// Доводит до конца уплотнение, прерванное сбоем после записи намерения: новые сегменты подменяют старые,
+// освобожденные сегменты обнуляются. Недописанное намерение означает, что сегменты еще не трогали.
+// Возвращает true, если сегменты менялись и манифест нужно перестроить
+bool finish_compaction() {
+    ifstream intent(compaction_path());
+    if (!intent) {
+        return false;
+    }
+    vector<pair<string, int>> steps;
+    string kind;
+    int segment;
+    bool complete = false;
+    while (intent >> kind) {
+        if (kind == "end") {
+            complete = true;
+            break;
+        }
+        if (!(intent >> segment)) {
+            break;
+        }
+        steps.push_back({kind, segment});
+    }
+    intent.close();
+    if (complete) {
+        for (const pair<string, int>& step : steps) {
+            if (step.first == "rename") {
+                rename(compaction_temp_path(step.second).c_str(), segment_path(step.second).c_str());  // Уже подмененный пропускается
+            } else {
+                truncate(segment_path(step.second).c_str(), 0);
+            }
+            unlink(columnar_path(step.second).c_str());
+            unlink(zone_path(step.second).c_str());
+        }
+        unlink(manifest_path().c_str());  // Манифест перестраивается по сегментам на диске
+        cerr << "Таблица " << table_name << ": завершено прерванное уплотнение сегментов" << endl;
+    }
+    unlink(compaction_path().c_str());
+    return complete;
+}
+
+// Ограничивает скорость фонового ввода-вывода уплотнения; false — уплотнение пора остановить
+static bool compaction_throttle(long long bytes, long long& done, chrono::steady_clock::time_point started, const atomic<bool>& stop) {
+    done += bytes;
+    while (!stop) {
+        double ahead = (double)done / compact_rate - chrono::duration<double>(chrono::steady_clock::now() - started).count();
+        if (ahead <= 0) {
+            return true;
+        }
+        usleep(min(ahead, 0.05) * 1000000);  // Короткими паузами, чтобы остановка не ждала
+    }
+    return false;
+}
+
+static bool sync_file(const string& file_path) {
+    int fd = open(file_path.c_str(), O_RDONLY);
+    bool synced = fd >= 0 && fsync(fd) == 0;
+    if (fd >= 0) {
+        close(fd);
+    }
+    return synced;
+}
+
+// Шаг фонового уплотнения: подряд идущие недозаполненные запечатанные сегменты сливаются в полные,
+// удаленные строки отбрасываются, освободившиеся сегменты становятся пустыми файлами и при чтении пропускаются.
+// Сегменты читаются и пишутся без блокировки таблицы со скоростью не выше compact_rate; подмена делается
+// под блокировкой и только если окно с тех пор не менялось. Возвращает число переписанных байт, 0 — уплотнять нечего
+long long compact_step(const atomic<bool>& stop) {
+    struct Snapshot {
+        int segment;
+        int rows;
+        long long bytes;
+        int dead;
+    };
+    vector<Snapshot> window;
+    vector<int> index_columns;  // Индексы могут добавиться, пока сегменты читаются без блокировки
+    auto worth = [&]() {
+        long long rows = 0, dead = 0;
+        for (const Snapshot& s : window) {
+            rows += s.rows;
+            dead += s.dead;
+        }
+        long long outputs = (rows - dead + tuples_limit - 1) / tuples_limit;
+        return !window.empty() && (outputs < (long long)window.size() || dead * 4 > rows);
+    };
+
+    table_lock.sharedLock();
+    int sealed = (int)segment_rows.size() - 1;  // Хвостовой сегмент не уплотняется: в него дописывают
+    for (int i = 0; i < sealed && window.size() < COMPACT_WINDOW; ++i) {
+        if (segment_bytes[i] == 0) {
+            continue;  // Освобожден прошлым уплотнением
+        }
+        int alive = segment_rows[i] - segment_dead[i];
+        if (alive * 4 >= tuples_limit * 3 && segment_dead[i] * 4 <= segment_rows[i]) {  // Заполнен и почти без удаленных
+            if (worth()) {
+                break;
+            }
+            window.clear();
+            continue;
+        }
+        window.push_back(Snapshot{i + 1, segment_rows[i], segment_bytes[i], segment_dead[i]});
+    }
+    bool found = worth();
+    for (const ColumnIndex& index : indexes) {
+        index_columns.push_back(index.col_index);
+    }
+    string header = header_line();
+    table_lock.sharedUnlock();
+    if (!found) {
+        return 0;
+    }
+
+    struct Moved {
+        int pk;
+        int from, to;
+        unsigned offset;
+        vector<string> keys;
+    };
+    vector<Moved> moved;
+    vector<int> out_rows;
+    vector<long long> out_bytes;
+    auto started = chrono::steady_clock::now();
+    long long io_bytes = 0;
+    bool ok = true;
+    string out;
+    RowFields fields;
+    auto flush = [&](int rows) {
+        string temp_path = compaction_temp_path(window[out_rows.size()].segment);
+        unlink(temp_path.c_str());
+        ok = ok && append_to_file(temp_path, out) && sync_file(temp_path) && compaction_throttle(out.size(), io_bytes, started, stop);
+        out_rows.push_back(rows);
+        out_bytes.push_back(out.size());
+        out.clear();
+    };
+    int rows = 0;
+    for (size_t w = 0; w < window.size() && ok; ++w) {
+        SegmentReader reader;
+        if (!reader.open(segment_path(window[w].segment)) || reader.size != (size_t)window[w].bytes) {
+            ok = false;
+            break;
+        }
+        const char* line;
+        size_t len;
+        reader.next_line(line, len);  // Заголовок
+        while (ok && reader.next_row(fields)) {
+            if (rows == tuples_limit) {
+                if (out_rows.size() + 1 >= window.size()) {
+                    ok = false;  // Строк больше, чем было в снимке: сегменты менялись
+                    break;
+                }
+                flush(rows);
+                rows = 0;
+            }
+            if (out.empty()) {
+                out = header;
+            }
+            long long pk = 0;
+            WhereCond::parse_number(fields.fields[0], pk);
+            Moved row{(int)pk, window[w].segment, window[out_rows.size()].segment, (unsigned)out.size(), vector<string>(index_columns.size())};
+            for (size_t k = 0; k < index_columns.size(); ++k) {
+                if (index_columns[k] < (int)fields.fields.size()) {
+                    WhereCond::cell_key(fields.fields[index_columns[k]], row.keys[k]);
+                }
+            }
+            moved.push_back(move(row));
+            out.append(fields.line, fields.line_len);
+            out += '\n';
+            rows++;
+        }
+        ok = ok && compaction_throttle(window[w].bytes, io_bytes, started, stop);
+    }
+    if (ok && rows > 0) {
+        flush(rows);
+    }
+
+    table_lock.tableLock();
+    if (wal) {
+        wal->begin_change();
+    }
+    bool unchanged = ok && indexes.size() == index_columns.size();
+    for (size_t k = 0; unchanged && k < indexes.size(); ++k) {
+        unchanged = indexes[k].col_index == index_columns[k];
+    }
+    for (const Snapshot& s : window) {
+        unchanged = unchanged && segment_rows[s.segment - 1] == s.rows && segment_bytes[s.segment - 1] == s.bytes &&
+                    segment_dead[s.segment - 1] == s.dead;
+    }
+    long long rewritten = 0;
+    if (unchanged) {
+        // Намерение на диске до первой подмены: после сбоя уплотнение доводится при открытии таблицы
+        string intent;
+        for (size_t w = 0; w < window.size(); ++w) {
+            intent += (w < out_rows.size() ? "rename " : "empty ") + to_string(window[w].segment) + "\n";
+        }
+        intent += "end\n";
+        unlink(compaction_path().c_str());
+        unchanged = append_to_file(compaction_path(), intent) && sync_file(compaction_path());
+    }
+    if (unchanged) {
+        for (size_t w = 0; w < window.size(); ++w) {
+            int segment = window[w].segment;
+            if (w < out_rows.size()) {
+                rename(compaction_temp_path(segment).c_str(), segment_path(segment).c_str());
+                segment_rows[segment - 1] = out_rows[w];
+                segment_bytes[segment - 1] = out_bytes[w];
+                rewritten += out_bytes[w];
+            } else {
+                truncate(segment_path(segment).c_str(), 0);
+                sync_file(segment_path(segment));
+                segment_rows[segment - 1] = 0;
+                segment_bytes[segment - 1] = 0;
+            }
+            segment_dead[segment - 1] = 0;
+            unlink(columnar_path(segment).c_str());
+            unlink(zone_path(segment).c_str());
+            uncache(segment);
+        }
+        sync_file(table_path);  // Подмены и обнуления на диске раньше, чем исчезнет намерение
+        unlink(compaction_path().c_str());
+
+        string pk_out;
+        vector<string> index_out(indexes.size());
+        for (const Moved& row : moved) {
+            set_pk_location(row.pk, RowLocation{row.to, row.offset});
+            append_pk_record(pk_out, row.pk, RowLocation{row.to, row.offset});
+            if (row.from == row.to) {
+                continue;
+            }
+            for (size_t k = 0; k < indexes.size(); ++k) {
+                indexes[k].remove_entry(row.keys[k], row.pk);
+                indexes[k].add(row.keys[k], IndexEntry{row.to, row.pk});
+                ColumnIndex::append_removal(index_out[k], row.keys[k], IndexEntry{row.from, row.pk});
+                ColumnIndex::append_line(index_out[k], row.keys[k], IndexEntry{row.to, row.pk});
+            }
+        }
+        save_manifest();
+        append_index_changes(pk_out, index_out);
+        vector<int> outputs;
+        for (size_t w = 0; w < out_rows.size(); ++w) {
+            outputs.push_back(window[w].segment - 1);
+        }
+        refresh_zones(outputs);
+        if (columnar) {
+            refresh_columnar(outputs);
+        }
+    } else {
+        for (size_t w = 0; w < out_rows.size(); ++w) {
+            unlink(compaction_temp_path(window[w].segment).c_str());  // Окно изменилось или уплотнение остановлено
+        }
+    }
+    if (wal) {
+        wal->end_change();
+    }
+    table_lock.tableUnlock();
+    return rewritten;
+}
+
+// Число живых строк по манифесту
+long long row_count() const {
+    long long rows = 0;
+    for (size_t i = 0; i < segment_rows.size(); ++i) {
+        rows += segment_rows[i] - segment_dead[i];
+    }
+    return rows;
+}
+
+// Параллельный обход строк всех сегментов или только перечисленных в only: visit(номер сегмента с нуля, строка).
+// visit вызывается из рабочих потоков, строки одного сегмента приходят по порядку из одного потока.
+template <class Visit>
+void scan_rows(Visit visit, const vector<int>* only = nullptr) {
+    int tasks = only ? only->size() : segment_rows.size();
+    WorkerPool::instance().run(tasks, [&](int task) {
+        scan_segment(only ? (*only)[task] : task, visit);
+    });
+}
+
+// Сегмент берется разобранным из SegmentCache; при промахе читается из файла и, если помещается, кэшируется
+template <class Visit>
+void scan_segment(int i, Visit& visit) {
+    if (segment_bytes[i] == 0) {
+        return;  // Сегмент освобожден уплотнением
+    }
+    ScanStats stats;
+    stats.segments = 1;
+    RowFields fields;
+    uint64_t key = SegmentCache::key(cache_id, i + 1);
+    shared_ptr<const CachedSegment> cached;
+    if (SegmentCache::budget > 0) {
+        cached = SegmentCache::instance().find(key, segment_bytes[i], segment_dead[i]);
+        stats.cached = cached != nullptr;
+    }
+
+    if (!cached) {
+        string file_path = segment_path(i + 1);
+        SegmentReader reader;
+        if (!reader.open(file_path)) {
+            cerr << "Ошибка: Не удалось открыть файл " << file_path << endl;
+            return;
+        }
+        const char* header;
+        size_t header_len;
+        reader.next_line(header, header_len);  // Пропускаем заголовок
+        stats.bytes = reader.size;
+
+        if (SegmentCache::admits(segment_bytes[i]) && (long long)reader.size == segment_bytes[i]) {
+            shared_ptr<CachedSegment> built = make_shared<CachedSegment>();
+            built->csv_bytes = segment_bytes[i];
+            built->dead = segment_dead[i];
+            built->build(reader);
+            SegmentCache::instance().insert(key, built);
+            cached = built;
+        } else {
+            while (reader.next_row(fields)) {
+                stats.rows++;
+                if (!visit_row(visit, i, fields)) {
+                    break;
+                }
+            }
+            stats.collect_predicates();
+            record_scan(stats);
+            return;
+        }
+    }
+
+    for (size_t r = 0; r < cached->rows(); ++r) {
+        cached->row(r, fields);
+        stats.rows++;
+        if (!visit_row(visit, i, fields)) {
+            break;
+        }
+    }
+    stats.collect_predicates();
+    record_scan(stats);
+}
+
+// Сегмент изменился: разобранная копия в кэше больше не нужна
+void uncache(int segment) const {
+    if (SegmentCache::budget > 0) {
+        SegmentCache::instance().invalidate(SegmentCache::key(cache_id, segment));
+    }
+}
+
+// Счетчики сканирования попадают в статистику таблицы и выполняемого запроса
+void record_scan(const ScanStats& stats) const {
+    counters.add(stats);
+    if (query_counters) {
+        query_counters->add(stats);
+    }
+}
+
+// visit может вернуть false, чтобы прекратить чтение сегмента (например, LIMIT уже набран); void — читать дальше
+template <class Visit>
+static bool visit_row(Visit& visit, int segment, const RowFields& fields) {
+    if constexpr (is_same<decltype(visit(segment, fields)), bool>::value) {
+        return visit(segment, fields);
+    } else {
+        visit(segment, fields);
+        return true;
+    }
+}
+
+// Обход строк, удовлетворяющих predicate. Сегменты с актуальной колоночной копией выполняются пакетно по .col:
+// заполнены только ячейки колонок output, строка целиком (fields.line) недоступна. Остальные читаются из CSV.
+template <class Visit>
+void scan_columns(const vector<bool>& output, const WherePredicate& predicate, Visit visit, const vector<int>* only = nullptr) {
+    int tasks = only ? only->size() : segment_rows.size();
+    WorkerPool::instance().run(tasks, [&](int task) {
+        int i = only ? (*only)[task] : task;
+        if (zone_excludes(i, predicate)) {
+            return;
+        }
+        if (columnar && columnar_eligible(i)) {
+            ColumnarSegment segment;
+            if (segment.open_map(columnar_path(i + 1)) && segment.csv_bytes == segment_bytes[i] &&
+                segment.dead == segment_dead[i] && segment.columns == columns_count + 1) {
+                ScanStats stats;
+                stats.segments = 1;
+                stats.bytes = segment.map_size;
+                stats.rows = segment_rows[i] - segment_dead[i];
+                stats.evaluations = predicate.empty() ? 0 : stats.rows;  // Условие проверяется блоками по колонкам
+                segment.scan(output, predicate, [&](const RowFields& fields) {
+                    stats.matched++;
+                    return visit_row(visit, i, fields);
+                });
+                stats.collect_predicates();
+                record_scan(stats);
+                return;
+            }
+        }
+        auto matching = [&](int segment, const RowFields& fields) {
+            return !predicate.matches(fields) || visit_row(visit, segment, fields);
+        };
+        scan_segment(i, matching);
+    });
+}
+
+string columnar_path(int segment) const {
+    return table_path + "/" + to_string(segment) + ".col";
+}
+
+string storage_path() const {
+    return table_path + "/" + table_name + "_storage";
+}
+
+// В сегмент больше не дописывают: он не последний или заполнен
+bool columnar_eligible(int i) const {
+    return i < (int)segment_rows.size() - 1 || segment_rows[i] >= tuples_limit;
+}
+
+// Перестраивает колоночные копии перечисленных сегментов (номера с нуля), параллельно
+void refresh_columnar(const vector<int>& segments) {
+    vector<int> eligible;
+    for (int i : segments) {
+        if (i < (int)segment_rows.size() && columnar_eligible(i) && segment_bytes[i] > 0) {
+            eligible.push_back(i);
+        }
+    }
+    WorkerPool::instance().run(eligible.size(), [&](int task) {
+        int i = eligible[task];
+        if (!ColumnarSegment::build(segment_path(i + 1), columnar_path(i + 1), segment_bytes[i], segment_dead[i], columns_count + 1)) {
+            unlink(columnar_path(i + 1).c_str());  // Сегмент остается только в CSV
+        }
+    });
+}
+
+string zone_path(int segment) const {
+    return table_path + "/" + to_string(segment) + ".zone";
+}
+
+// Перестраивает карты зон перечисленных запечатанных сегментов (номера с нуля), параллельно
+void refresh_zones(const vector<int>& segments) {
+    vector<int> eligible;
+    for (int i : segments) {
+        if (i < (int)segment_rows.size() && columnar_eligible(i) && segment_bytes[i] > 0) {
+            eligible.push_back(i);
+        } else {
+            unlink(zone_path(i + 1).c_str());  // Переписанный сегмент снова дописываемый или пуст
+        }
+    }
+    WorkerPool::instance().run(eligible.size(), [&](int task) {
+        int i = eligible[task];
+        if (!ZoneMap::build(segment_path(i + 1), zone_path(i + 1), segment_bytes[i], segment_rows[i], columns_count + 1)) {
+            unlink(zone_path(i + 1).c_str());  // Сегмент читается всегда
+        }
+    });
+}
+
+// Карты зон есть у всех запечатанных сегментов: недостающие и устаревшие строятся при открытии
+void load_zones() {
+    vector<int> stale;
+    for (int i = 0; i < (int)segment_rows.size(); ++i) {
+        ZoneMap zones;
+        if (columnar_eligible(i) && segment_bytes[i] > 0 && !(zones.read_header(zone_path(i + 1)) &&
+            zones.csv_bytes == segment_bytes[i] && zones.rows == segment_rows[i])) {
+            stale.push_back(i);
+        }
+    }
+    refresh_zones(stale);
+}
+
+// true, если по карте зон сегмента в нем нет строк, удовлетворяющих сравнениям predicate для таблицы slot.
+// Пропущенный сегмент учитывается в статистике сканирования.
+bool zone_excludes(int i, const WherePredicate& predicate, int slot = 0) const {
+    if (predicate.empty() || !predicate.valid || !columnar_eligible(i) || segment_bytes[i] == 0) {
+        return false;
+    }
+    ZoneMap zones;
+    if (!zones.open_map(zone_path(i + 1)) || zones.csv_bytes != segment_bytes[i] || zones.rows != segment_rows[i] ||
+        (zones.columns != 0 && zones.columns != columns_count + 1) || !zones.excludes(predicate, slot)) {
+        return false;
+    }
+    ScanStats stats;
+    stats.pruned = 1;
+    record_scan(stats);
+    return true;
+}
+
+// Сегменты, которые нужно читать при условии predicate для таблицы slot (проверка карт зон идет параллельно)
+vector<int> zone_candidates(const WherePredicate& predicate, int slot) const {
+    vector<char> excluded(segment_rows.size(), 0);
+    if (!predicate.empty() && predicate.valid) {
+        WorkerPool::instance().run(excluded.size(), [&](int i) {
+            excluded[i] = zone_excludes(i, predicate, slot);
+        });
+    }
+    vector<int> candidates;
+    for (size_t i = 0; i < excluded.size(); ++i) {
+        if (!excluded[i]) {
+            candidates.push_back(i);
+        }
+    }
+    return candidates;
+}
+
+// Режим хранения читается при открытии; устаревшие колоночные копии перестраиваются сразу
+void load_columnar() {
+    ifstream storage(storage_path());
+    string mode;
+    columnar = storage >> mode && mode == "columnar";
+    if (!columnar) {
+        return;
+    }
+    vector<int> stale;
+    for (int i = 0; i < (int)segment_rows.size(); ++i) {
+        ColumnarSegment segment;
+        if (columnar_eligible(i) && !(segment.read_header(columnar_path(i + 1)) &&
+            segment.csv_bytes == segment_bytes[i] && segment.dead == segment_dead[i])) {
+            stale.push_back(i);
+        }
+    }
+    refresh_columnar(stale);
+}
+
+void set_storage(bool enable, ostream& out) {
+    table_lock.tableLock();  // Блокируем таблицу
+
+    columnar = enable;
+    int built = 0;
+    if (enable) {
+        ofstream storage(storage_path());
+        storage << "columnar\n";
+        storage.close();
+        vector<int> all(segment_rows.size());
+        for (size_t i = 0; i < all.size(); ++i) {
+            all[i] = i;
+        }
+        refresh_columnar(all);
+        struct stat st;
+        for (size_t i = 0; i < all.size(); ++i) {
+            built += stat(columnar_path(i + 1).c_str(), &st) == 0;
+        }
+        out << "Таблица " << table_name << " хранится по колонкам, колоночных сегментов: " << built << endl;
+    } else {
+        unlink(storage_path().c_str());
+        for (size_t i = 0; i < segment_rows.size(); ++i) {
+            unlink(columnar_path(i + 1).c_str());
+        }
+        out << "Таблица " << table_name << " хранится только в CSV" << endl;
+    }
+
+    table_lock.tableUnlock();  // Разблокируем таблицу
+}
+
+// Просматривает все сегменты таблицы параллельно; результаты объединяются в порядке сегментов.
+// ORDER BY сортирует строки (при LIMIT — ограниченной кучей на сегмент, иначе внешней сортировкой),
+// LIMIT без ORDER BY читает сегменты волнами и останавливается, как только набрано нужное число строк.
+void selectRows(const string columns[], int col_count, const WherePredicate& predicate, ResultSink& sink, const SortSpec& sort_spec = SortSpec()) {
+    vector<ColumnRef> projection;  // Индексы выводимых ячеек, найденные один раз на запрос
+    for (int i = 0; i < col_count; ++i) {
+        int index = get_column_ind(columns[i]);
+        if (index == -1) {
+            cerr << "Столбец не найден " << columns[i] << endl;
+            return;
+        }
+        projection.push_back({0, index});
+    }
+    int order_index = -1;
+    if (!sort_spec.column.empty()) {
+        order_index = get_column_ind(sort_spec.column);
+        if (order_index == -1) {
+            cerr << "Столбец не найден " << sort_spec.column << endl;
+            return;
+        }
+    }
+    sink.begin("Вывод выбранных колонок:", columns, col_count);
+    RowEncoder encoder = sink.encoder();
+    long long limit = sort_spec.limit;
+    if (limit == 0) {
+        sink.finish();
+        return;
+    }
+
+    table_lock.sharedLock();  // Чтение не мешает другим SELECT, но ждет изменений таблицы
+    vector<string> results(segment_rows.size());  // Вывод, сформированный по каждому сегменту
+
+    // Точечный доступ: строки читаются прямо по смещениям из индекса первичного ключа
+    vector<int> pks;
+    if (pk_candidates(predicate, pks)) {
+        string line;
+        RowFields fields;
+        vector<SortRow> rows;
+        string scratch;
+        ScanStats stats;
+        for (int pk : pks) {
+            RowLocation location = find_pk(pk);
+            if (location.segment == 0 || !read_row_at(location, line, stats)) {
+                continue;
+            }
+            fields.split(line);
+            if (predicate.matches(fields)) {
+                SortRow row{false, 0, "", (long long)rows.size(), ""};
+                const RowFields* row_fields[1] = {&fields};
+                printSelCol(row_fields, projection, encoder, row.output);
+                if (order_index >= 0 && order_index < (int)fields.fields.size()) {
+                    RowSorter::make_key(fields.fields[order_index], row, scratch);
+                }
+                rows.push_back(move(row));
+            }
+        }
+        stats.collect_predicates();
+        record_scan(stats);
+        table_lock.sharedUnlock();
+        if (order_index >= 0) {
+            sort(rows.begin(), rows.end(), RowOrder{sort_spec.descending});
+        }
+        for (size_t i = 0; i < rows.size() && (limit < 0 || (long long)i < limit); ++i) {
+            sink.append(rows[i].output);
+        }
+        sink.finish();
+        return;
+    }
+
+    vector<int> candidates;
+    bool use_index = index_candidates(predicate, candidates);
+    if (!use_index) {
+        for (size_t i = 0; i < segment_rows.size(); ++i) {
+            candidates.push_back(i);
+        }
+    }
+
+    // Выводимые колонки: из колоночных сегментов печатаются только они
+    vector<bool> output(columns_count + 1, false);
+    for (const ColumnRef& ref : projection) {
+        output[ref.index] = true;
+    }
+    if (order_index >= 0) {
+        output[order_index] = true;
+    }
+
+    if (order_index >= 0) {
+        vector<vector<SortRow>> buffers(segment_rows.size());
+        vector<size_t> buffer_bytes(segment_rows.size(), 0);
+        vector<long long> row_numbers(segment_rows.size(), 0);
+        vector<string> scratch(segment_rows.size());
+        RowOrder order{sort_spec.descending};
+        RowSorter sorter(sort_spec.descending, table_path);
+        // Небольшой LIMIT: на сегмент хранится куча из limit лучших строк, на диск ничего не пишется
+        bool top_n = limit > 0 && limit <= 100000;
+
+        scan_columns(output, predicate, [&](int segment, const RowFields& fields) {
+            SortRow row{false, 0, "", ((long long)segment << 32) | row_numbers[segment]++, ""};
+            if (order_index < (int)fields.fields.size()) {
+                RowSorter::make_key(fields.fields[order_index], row, scratch[segment]);
+            }
+            vector<SortRow>& buffer = buffers[segment];
+            if (top_n && (long long)buffer.size() == limit && !order(row, buffer.front())) {
+                return;  // Строка хуже худшей из уже отобранных
+            }
+            const RowFields* rows[1] = {&fields};
+            printSelCol(rows, projection, encoder, row.output);
+            if (top_n) {
+                buffer.push_back(move(row));
+                push_heap(buffer.begin(), buffer.end(), order);
+                if ((long long)buffer.size() > limit) {
+                    pop_heap(buffer.begin(), buffer.end(), order);
+                    buffer.pop_back();
+                }
+            } else {
+                sorter.add(buffer, buffer_bytes[segment], move(row));
+            }
+        }, &candidates);
+        table_lock.sharedUnlock();
+
+        for (vector<SortRow>& buffer : buffers) {
+            sorter.finish(buffer);
+        }
+        sorter.merge(sink, limit);
+        sink.finish();
+        return;
+    }
+
+    if (limit > 0) {
+        // Сегменты читаются волнами по числу потоков; внутри сегмента чтение прекращается после limit строк
+        vector<long long> counts(segment_rows.size(), 0);
+        vector<vector<size_t>> row_ends(segment_rows.size());  // Конец каждой строки в выводе сегмента
+        long long total = 0;
+        size_t wave_size = WorkerPool::instance().threads.size() + 1;
+        for (size_t first = 0; first < candidates.size() && total < limit; first += wave_size) {
+            vector<int> wave(candidates.begin() + first, candidates.begin() + min(candidates.size(), first + wave_size));
+            scan_columns(output, predicate, [&](int segment, const RowFields& fields) {
+                const RowFields* rows[1] = {&fields};
+                printSelCol(rows, projection, encoder, results[segment]);
+                row_ends[segment].push_back(results[segment].size());
+                return ++counts[segment] + total < limit;
+            }, &wave);
+            for (int segment : wave) {
+                total += counts[segment];
+            }
+        }
+        table_lock.sharedUnlock();
+
+        // Лишние строки последней волны отбрасываются с конца в порядке сегментов
+        long long left = limit;
+        for (size_t i = 0; i < results.size(); ++i) {
+            if (left <= 0) {
+                results[i].clear();
+                continue;
+            }
+            long long rows = min(left, counts[i]);
+            results[i].resize(rows > 0 ? row_ends[i][rows - 1] : 0);
+            left -= rows;
+            sink.append(results[i]);
+        }
+        sink.finish();
+        return;
+    }
+
+    scan_columns(output, predicate, [&](int segment, const RowFields& fields) {
+        // Сюда приходят только строки, удовлетворяющие WHERE; ячейки копируются только при выводе
+        const RowFields* rows[1] = {&fields};
+        printSelCol(rows, projection, encoder, results[segment]);
+    }, use_index ? &candidates : nullptr);
+    table_lock.sharedUnlock();
+
+    for (const string& result : results) {
+        sink.append(result);
+    }
+    sink.finish();
+}
+
+// Агрегирующий SELECT: items — колонки GROUP BY и функции COUNT/SUM/MIN/MAX/AVG.
+// Каждый сегмент агрегируется в свою хеш-таблицу групп в рабочем потоке, строки не копируются;
+// частичные агрегаты сливаются в конце, группы выводятся в порядке ключа.
+void aggregateRows(const vector<string>& items, const vector<string>& group_by, const WherePredicate& predicate, ResultSink& sink) {
+    vector<int> group_cols;
+    for (const string& column : group_by) {
+        int index = get_column_ind(column);
+        if (index == -1) {
+            cerr << "Столбец не найден " << column << endl;
+            return;
+        }
+        group_cols.push_back(index);
+    }
+
+    vector<AggregateItem> aggregates;
+    for (const string& item : items) {
+        AggregateItem aggregate{AGG_GROUP, -1, -1, item};
+        size_t open = item.find('(');
+        size_t close = item.rfind(')');
+        if (open == string::npos) {
+            int index = get_column_ind(item);
+            for (size_t g = 0; g < group_cols.size(); ++g) {
+                if (group_cols[g] == index) {
+                    aggregate.group_pos = g;
+                }
+            }
+            if (index == -1 || aggregate.group_pos < 0) {
+                cerr << "Колонка " << item << " должна быть в GROUP BY или внутри агрегатной функции" << endl;
+                return;
+            }
+        } else {
+            string func = item.substr(0, open);
+            string arg = close == string::npos || close < open ? "" : item.substr(open + 1, close - open - 1);
+            func.erase(remove(func.begin(), func.end(), ' '), func.end());
+            arg.erase(remove(arg.begin(), arg.end(), ' '), arg.end());
+            transform(func.begin(), func.end(), func.begin(), ::toupper);
+            if (func == "COUNT") aggregate.func = AGG_COUNT;
+            else if (func == "SUM") aggregate.func = AGG_SUM;
+            else if (func == "MIN") aggregate.func = AGG_MIN;
+            else if (func == "MAX") aggregate.func = AGG_MAX;
+            else if (func == "AVG") aggregate.func = AGG_AVG;
+            else {
+                cerr << "Неизвестная агрегатная функция: " << item << endl;
+                return;
+            }
+            if (!(aggregate.func == AGG_COUNT && arg == "*")) {
+                aggregate.col_index = get_column_ind(arg);
+                if (aggregate.col_index == -1) {
+                    cerr << "Столбец не найден " << arg << endl;
+                    return;
+                }
+            }
+        }
+        aggregates.push_back(aggregate);
+    }
+
+    // Читаются только колонки групп и аргументов функций
+    vector<bool> output(columns_count + 1, false);
+    for (int index : group_cols) {
+        output[index] = true;
+    }
+    for (const AggregateItem& aggregate : aggregates) {
+        if (aggregate.col_index >= 0) {
+            output[aggregate.col_index] = true;
+        }
+    }
+
+    typedef unordered_map<string, vector<AggregateState>> Groups;  // Ключ — значения колонок группы через '\x1f'
+    table_lock.sharedLock();
+    vector<Groups> partials(max((size_t)1, segment_rows.size()));
+    vector<string> keys(partials.size());
+    vector<string> cells(partials.size());
+    vector<string> scratch(partials.size());
+    auto visit = [&](int segment, const RowFields& fields) {
+        string& key = keys[segment];
+        string& cell = cells[segment];
+        key.clear();
+        for (size_t g = 0; g < group_cols.size(); ++g) {
+            if (g > 0) {
+                key += '\x1f';
+            }
+            if (group_cols[g] < (int)fields.fields.size()) {
+                WhereCond::cell_key(fields.fields[group_cols[g]], cell);
+                key += cell;
+            }
+        }
+        Groups::iterator group = partials[segment].find(key);
+        if (group == partials[segment].end()) {
+            group = partials[segment].emplace(key, vector<AggregateState>(aggregates.size())).first;
+        }
+        for (size_t k = 0; k < aggregates.size(); ++k) {
+            const AggregateItem& aggregate = aggregates[k];
+            if (aggregate.func == AGG_GROUP) {
+                continue;
+            }
+            const FieldSpan* value = nullptr;
+            FieldSpan missing{"", 0};
+            if (aggregate.col_index >= 0) {
+                value = aggregate.col_index < (int)fields.fields.size() ? &fields.fields[aggregate.col_index] : &missing;
+            }
+            group->second[k].add(aggregate.func, value, scratch[segment]);
+        }
+    };
+
+    vector<int> pks;
+    if (pk_candidates(predicate, pks)) {
+        string line;
+        RowFields fields;
+        ScanStats stats;
+        for (int pk : pks) {
+            RowLocation location = find_pk(pk);
+            if (location.segment != 0 && read_row_at(location, line, stats)) {
+                fields.split(line);
+                if (predicate.matches(fields)) {
+                    visit(0, fields);
+                }
+            }
+        }
+        stats.collect_predicates();
+        record_scan(stats);
+    } else {
+        vector<int> candidates;
+        bool use_index = index_candidates(predicate, candidates);
+        scan_columns(output, predicate, visit, use_index ? &candidates : nullptr);
+    }
+    table_lock.sharedUnlock();
+
+    map<string, vector<AggregateState>> groups;  // Слияние частичных агрегатов, упорядоченное по ключу
+    for (Groups& partial : partials) {
+        for (auto& group : partial) {
+            auto merged = groups.find(group.first);
+            if (merged == groups.end()) {
+                groups.emplace(group.first, move(group.second));
+            } else {
+                for (size_t k = 0; k < aggregates.size(); ++k) {
+                    merged->second[k].merge(group.second[k]);
+                }
+            }
+        }
+    }
+    if (groups.empty() && group_cols.empty()) {
+        groups.emplace("", vector<AggregateState>(aggregates.size()));  // Без GROUP BY строка результата есть всегда
+    }
+
+    vector<string> labels;
+    for (const AggregateItem& aggregate : aggregates) {
+        labels.push_back(aggregate.label);
+    }
+    sink.begin("Вывод агрегатов:", labels.data(), labels.size());
+    RowEncoder encoder = sink.encoder();
+    string result;
+    for (const auto& group : groups) {
+        vector<string> values;
+        size_t start = 0;
+        while (true) {
+            size_t separator = group.first.find('\x1f', start);
+            values.push_back(group.first.substr(start, separator - start));
+            if (separator == string::npos) {
+                break;
+            }
+            start = separator + 1;
+        }
+        encoder.begin(result);
+        for (size_t k = 0; k < aggregates.size(); ++k) {
+            string value = aggregates[k].func == AGG_GROUP ? values[aggregates[k].group_pos] : group.second[k].result(aggregates[k].func);
+            encoder.cell(k, value.data(), value.size(), result);
+        }
+        encoder.end(result);
+    }
+    sink.append(result);
+    sink.finish();
+}
+
+int get_column_ind(const string& column_name) {
+    string table_prefix;
+    string actual_column;
+
+    // Если колонка имеет формат "table.column", разбиваем её
+    size_t dot_pos = column_name.find('.');
+    if (dot_pos != string::npos) {
+        table_prefix = column_name.substr(0, dot_pos);
+        actual_column = column_name.substr(dot_pos + 1);
+    } else {
+        actual_column = column_name;
+    }
+
+    if (!table_prefix.empty() && table_prefix != table_name) {
+        return -1;
+    }
+    if (actual_column == table_name + "_pk") {
+        return 0;  // Первичный ключ — первая ячейка строки
+    }
+
+    // Проверка, является ли колонка частью данной таблицы
+    for (int i = 0; i < columns_count; ++i) {
+        if (columns[i] == actual_column) {
+            return i + 1;  // Возвращаем индекс колонки
+        }
+    }
+    return -1;
+}
+
+
+// Компилирует лексемы условия WHERE [begin, end) с разрешением колонок этой таблицы
+WherePredicate compile_where(const SqlTokens& tokens, size_t begin, size_t end, vector<WherePredicate::ParamSlot>& slots) {
+    return WherePredicate::compile(tokens, begin, end, [this](const string& column_name) {
+        return ColumnRef{0, get_column_ind(column_name)};
+    }, slots);
+}
+
+// Функция для печати выбранных колонок: projection[k] — ячейка для колонки k результата в строке rows[slot]
+static void printSelCol(const RowFields* const* rows, const vector<ColumnRef>& projection, const RowEncoder& encoder, string& out) {
+    encoder.begin(out);
+    for (size_t k = 0; k < projection.size(); ++k) {
+        const RowFields& row = *rows[projection[k].slot];
+        if (projection[k].index >= (int)row.fields.size()) {
+            if (encoder.format != FORMAT_TEXT) {
+                encoder.cell(k, "", 0, out);  // Табличные форматы сохраняют число колонок
+            }
+            continue;
+        }
+        const FieldSpan& cell = row.fields[projection[k].index];
+        encoder.cell(k, cell.ptr, cell.len, out);
+    }
+    encoder.end(out);
+}
+};
+
+long long Table::compact_rate = 16LL << 20;
+
+// Колонка соединения: ищется сначала в первой таблице, затем во второй
+static ColumnRef resolve_join_column(Table* const tables[2], const string& column_name) {
+    for (int slot = 0; slot < 2; ++slot) {
+        int index = tables[slot]->get_column_ind(column_name);
+        if (index != -1) {
+            return ColumnRef{slot, index};
+        }
+    }
+    return ColumnRef{0, -1};
+}
+
+enum PlanKind { PLAN_SELECT, PLAN_JOIN, PLAN_AGGREGATE, PLAN_DELETE, PLAN_INSERT };
+
+// Разобранный запрос с найденными таблицами и скомпилированным WHERE. Литералы запроса вынесены
+// в параметры, поэтому один план обслуживает все запросы одной формы; план не меняется после построения.
+struct QueryPlan {
+    PlanKind kind;
+    Table* tables[2] = {nullptr, nullptr};
+    vector<string> columns;  // Выводимые колонки; для агрегатов — элементы списка SELECT
+    vector<string> group_by;
+    WherePredicate where;
+    vector<WherePredicate::ParamSlot> where_params;
+    vector<SqlToken> where_tokens;  // Текст условия для сообщения DELETE
+    SortSpec sort;
+    int limit_param = -1;  // LIMIT задан параметром
+    vector<vector<SqlToken>> rows;  // Значения INSERT: литералы (WORD) или параметры
+    int param_count = 0;
+};
+
+// LRU-кэш планов по нормализованному тексту запроса (литералы заменены на ?); общий для всех сессий
+struct PlanCache {
+    static const size_t CAPACITY = 256;
+    static const size_t MAX_KEY = 4096;  // Длинные запросы (пакетные INSERT) не кэшируются
+
+    typedef list<pair<string, shared_ptr<const QueryPlan>>> Entries;
+    pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+    Entries entries;  // В начале — недавно использованные
+    unordered_map<string, Entries::iterator> by_key;
+    long long hits = 0;
+    long long misses = 0;
+
+    shared_ptr<const QueryPlan> find(const string& key) {
+        shared_ptr<const QueryPlan> plan;
+        pthread_mutex_lock(&lock);
+        auto it = by_key.find(key);
+        if (it != by_key.end()) {
+            entries.splice(entries.begin(), entries, it->second);
+            plan = it->second->second;
+            ++hits;
+        } else {
+            ++misses;
+        }
+        pthread_mutex_unlock(&lock);
+        return plan;
+    }
+
+    void insert(const string& key, const shared_ptr<const QueryPlan>& plan) {
+        if (key.size() > MAX_KEY) {
+            return;
+        }
+        pthread_mutex_lock(&lock);
+        if (by_key.find(key) == by_key.end()) {
+            entries.emplace_front(key, plan);
+            by_key[key] = entries.begin();
+            if (entries.size() > CAPACITY) {
+                by_key.erase(entries.back().first);
+                entries.pop_back();  // Выполняющиеся запросы держат свою копию shared_ptr
+            }
+        }
+        pthread_mutex_unlock(&lock);
+    }
+};
+
+// Таблица схемы: описание известно с запуска, сама таблица открывается при первом обращении
+struct CatalogEntry {
+    string name;
+    vector<string> columns;
+    atomic<Table*> table{nullptr};  // Таблицы не копируются: каждая держит свои блокировки
+};
+
+struct Database {
+    string schema_name;
+    int tuples_limit;
+    deque<CatalogEntry> catalog;  // Адреса элементов не меняются, пока живет база
+    unordered_map<string, size_t> table_index;  // Имя таблицы -> номер в catalog; после запуска только читается
+    pthread_mutex_t open_lock = PTHREAD_MUTEX_INITIALIZER;  // Открытие таблиц
+    bool wal_ready = false;  // Журнал открыт и проигран: новые таблицы сразу пишут в него
+    TableLock schema_lock;  // flock на схему: таблицы открываются лениво, а журнал у схемы общий
+    WriteAheadLog wal;
+    PlanCache plans;
+
+    // Фоновое уплотнение сегментов: один поток на схему, просыпается раз в COMPACT_INTERVAL_MS
+    pthread_t compactor;
+    bool compactor_running = false;
+    atomic<bool> stopping{false};
+    pthread_mutex_t compact_lock = PTHREAD_MUTEX_INITIALIZER;
+    pthread_cond_t compact_wake = PTHREAD_COND_INITIALIZER;
+    atomic<long long> compacted_steps{0};
+    atomic<long long> compacted_bytes{0};
+    static const int COMPACT_INTERVAL_MS = 1000;
+
+    Database(const string& config_file, FsyncPolicy fsync_policy = FSYNC_COMMIT, int fsync_interval_ms = 0) {
+        // Снимок каталога читается одним вызовом; JSON разбирается, только если конфигурация изменилась
+        if (!load_catalog(config_file)) {
+            parsJson schema(config_file);
+            schema_name = schema.name;
+            tuples_limit = schema.tuples_limit;
+            for (const parsJson::TableSchema& table : schema.structure) {
+                add_catalog_entry(table.table_name, table.columns);
+            }
+            save_catalog(config_file);
+        }
+
+        mkdir(schema_name.c_str(), 0777);
+        if (!schema_lock.processLock(schema_name + "/schema")) {
+            cerr << "Схема " << schema_name << " уже открыта другим процессом" << endl;
+            exit(1);
+        }
+
+        // Без журнала таблицы работают, но без гарантий сохранности
+        if (wal.open(schema_name + "/wal", fsync_policy, fsync_interval_ms)) {
+            replay_wal();
+            pthread_mutex_lock(&open_lock);
+            for (CatalogEntry& entry : catalog) {
+                if (Table* table = entry.table.load()) {
+                    table->wal = &wal;  // Открытые при восстановлении
+                }
+            }
+            wal_ready = true;
+            pthread_mutex_unlock(&open_lock);
+        }
+
+        if (Table::compact_rate > 0) {
+            compactor_running = pthread_create(&compactor, nullptr, compact_loop, this) == 0;
+        }
+    }
+
+    static void* compact_loop(void* arg) {
+        Database* db = static_cast<Database*>(arg);
+        pthread_mutex_lock(&db->compact_lock);
+        while (!db->stopping) {
+            timespec deadline;
+            clock_gettime(CLOCK_REALTIME, &deadline);
+            long long nanos = deadline.tv_nsec + COMPACT_INTERVAL_MS * 1000000LL;
+            deadline.tv_sec += nanos / 1000000000;
+            deadline.tv_nsec = nanos % 1000000000;
+            pthread_cond_timedwait(&db->compact_wake, &db->compact_lock, &deadline);
+            pthread_mutex_unlock(&db->compact_lock);
+            for (size_t i = 0; i < db->catalog.size() && !db->stopping; ++i) {
+                Table* table = db->catalog[i].table.load(memory_order_acquire);
+                while (table && !db->stopping) {  // Неоткрытые таблицы не менялись с прошлого запуска
+                    long long bytes = table->compact_step(db->stopping);
+                    if (bytes == 0) {
+                        break;
+                    }
+                    db->compacted_steps++;
+                    db->compacted_bytes += bytes;
+                }
+            }
+            pthread_mutex_lock(&db->compact_lock);
+        }
+        pthread_mutex_unlock(&db->compact_lock);
+        return nullptr;
+    }
+
+    // Непустой журнал при открытии означает, что процесс не дошел до контрольной точки
+    void replay_wal() {
+        vector<string> records;
+        wal.read_all(records);
+        if (records.empty()) {
+            return;
+        }
+        cerr << "Восстановление после сбоя: записей журнала " << records.size() << endl;
+
+        // Первый проход: к какой таблице относится запись и какие ключи удаляются журналом
+        vector<int> owners(records.size(), -1);
+        vector<unordered_set<int>> deleted(catalog.size());
+        for (size_t r = 0; r < records.size(); ++r) {
+            const string& record = records[r];
+            size_t header_end = record.find('\n');
+            string table_name = header_end == string::npos ? "" : record.substr(2, header_end - 2);
+            auto found = table_index.find(table_name);
+            if (found != table_index.end()) {
+                owners[r] = found->second;
+            }
+            if (owners[r] < 0) {
+                cerr << "Запись журнала для неизвестной таблицы пропущена: " << table_name << endl;
+            } else if (record[0] == 'D') {
+                istringstream pks(record.substr(header_end + 1));
+                int pk;
+                while (pks >> pk) {
+                    deleted[owners[r]].insert(pk);
+                }
+            }
+        }
+
+        vector<bool> recovered(catalog.size(), false);
+        bool complete = true;
+        for (size_t r = 0; r < records.size(); ++r) {
+            int i = owners[r];
+            if (i < 0) {
+                continue;
+            }
+            Table* table = open_table(catalog[i]);  // Восстанавливаются только таблицы из журнала
+            if (!table) {
+                complete = false;  // Журнал сохраняется до следующего запуска: проигрывание повторяемо
+                continue;
+            }
+            if (!recovered[i]) {
+                table->recover();
+                recovered[i] = true;
+            }
+            table->replay(records[r][0], records[r].substr(records[r].find('\n') + 1), deleted[i]);
+        }
+        if (complete) {
+            wal.checkpoint(schema_name);
+        } else {
+            cerr << "Журнал восстановлен не полностью и сохранен: часть таблиц занята другим процессом" << endl;
+        }
+    }
+
+    void checkpoint_if_needed() {
+        if (wal.needs_checkpoint()) {
+            wal.checkpoint(schema_name);
+        }
+    }
+
+    Database(const Database&) = delete;
+    Database& operator=(const Database&) = delete;
+
+    ~Database() {
+        if (compactor_running) {
+            pthread_mutex_lock(&compact_lock);
+            stopping = true;
+            pthread_cond_signal(&compact_wake);
+            pthread_mutex_unlock(&compact_lock);
+            pthread_join(compactor, nullptr);
+        }
+        if (wal.fd >= 0) {
+            wal.checkpoint(schema_name);  // Штатное завершение: журнал больше не нужен
+        }
+        for (CatalogEntry& entry : catalog) {
+            delete entry.table.load();
+        }
+    }
+
+    // Поиск по хеш-таблице имен; таблица открывается при первом обращении
+    Table* find_table(const string& table_name) {
+        auto found = table_index.find(table_name);
+        if (found == table_index.end()) {
+            cerr << "Таблица не найдена: " << table_name << endl;
+            return nullptr;
+        }
+        CatalogEntry& entry = catalog[found->second];
+        Table* table = entry.table.load(memory_order_acquire);
+        return table ? table : open_table(entry);
+    }
+
+    // nullptr, если таблица занята другим процессом; следующее обращение попробует открыть ее снова
+    Table* open_table(CatalogEntry& entry) {
+        pthread_mutex_lock(&open_lock);
+        Table* table = entry.table.load();
+        if (!table) {
+            table = new Table(entry.name, entry.columns, tuples_limit, schema_name);
+            if (table->opened) {
+                table->wal = wal_ready ? &wal : nullptr;
+                entry.table.store(table, memory_order_release);
+            } else {
+                delete table;
+                table = nullptr;
+            }
+        }
+        pthread_mutex_unlock(&open_lock);
+        return table;
+    }
+
+    void add_catalog_entry(const string& name, const vector<string>& columns) {
+        if (!table_index.emplace(name, catalog.size()).second) {
+            cerr << "Таблица " << name << " описана в схеме дважды, используется первое описание" << endl;
+            return;
+        }
+        catalog.emplace_back();
+        catalog.back().name = name;
+        catalog.back().columns = columns;
+    }
+
+    // Снимок каталога: файл <конфигурация>.catalog с размером и временем изменения конфигурации,
+    // именем схемы, tuples_limit и описаниями таблиц; строки — [u32 длина][байты]
+    static const uint32_t CATALOG_MAGIC = 0x54433150;  // "P1CT"
+
+    static string catalog_path(const string& config_file) {
+        return config_file + ".catalog";
+    }
+
+    static bool config_stamp(const string& config_file, uint64_t stamp[2]) {
+        struct stat st;
+        if (stat(config_file.c_str(), &st) != 0) {
+            return false;
+        }
+        stamp[0] = st.st_size;
+        stamp[1] = st.st_mtim.tv_sec * 1000000000ULL + st.st_mtim.tv_nsec;
+        return true;
+    }
+
+    bool load_catalog(const string& config_file) {
+        uint64_t stamp[2];
+        int fd = ::open(catalog_path(config_file).c_str(), O_RDONLY);
+        struct stat st;
+        if (fd < 0 || !config_stamp(config_file, stamp) || fstat(fd, &st) != 0) {
+            if (fd >= 0) {
+                close(fd);
+            }
+            return false;
+        }
+        string data(st.st_size, '\0');
+        bool read_all = read(fd, &data[0], data.size()) == (ssize_t)data.size();
+        close(fd);
+
+        size_t pos = 0;
+        auto get_u32 = [&](uint32_t& value) {
+            if (pos + sizeof(value) > data.size()) return false;
+            memcpy(&value, data.data() + pos, sizeof(value));
+            pos += sizeof(value);
+            return true;
+        };
+        auto get_string = [&](string& value) {
+            uint32_t len;
+            if (!get_u32(len) || pos + len > data.size()) return false;
+            value.assign(data, pos, len);
+            pos += len;
+            return true;
+        };
+        uint32_t magic, limit, table_count;
+        uint64_t saved[2];
+        if (!read_all || !get_u32(magic) || magic != CATALOG_MAGIC || pos + sizeof(saved) > data.size()) {
+            return false;
+        }
+        memcpy(saved, data.data() + pos, sizeof(saved));
+        pos += sizeof(saved);
+        if (saved[0] != stamp[0] || saved[1] != stamp[1] || !get_string(schema_name) || !get_u32(limit) || !get_u32(table_count)) {
+            return false;  // Конфигурация изменилась после снимка
+        }
+        tuples_limit = limit;
+        for (uint32_t t = 0; t < table_count; ++t) {
+            string name;
+            uint32_t column_count;
+            if (!get_string(name) || !get_u32(column_count)) {
+                break;
+            }
+            vector<string> columns(column_count);
+            for (string& column : columns) {
+                get_string(column);
+            }
+            add_catalog_entry(name, columns);
+        }
+        if (pos != data.size() || catalog.size() != table_count) {
+            catalog.clear();
+            table_index.clear();
+            return false;
+        }
+        return true;
+    }
+
+    // Снимок пишется во временный файл и подменяется через rename; если каталог недоступен для записи,
+    // конфигурация просто разбирается при каждом запуске
+    void save_catalog(const string& config_file) {
+        uint64_t stamp[2];
+        if (!config_stamp(config_file, stamp)) {
+            return;
+        }
+        string data;
+        auto put_u32 = [&](uint32_t value) {
+            data.append(reinterpret_cast<const char*>(&value), sizeof(value));
+        };
+        auto put_string = [&](const string& value) {
+            put_u32(value.size());
+            data += value;
+        };
+        put_u32(CATALOG_MAGIC);
+        data.append(reinterpret_cast<const char*>(stamp), sizeof(stamp));
+        put_string(schema_name);
+        put_u32(tuples_limit);
+        put_u32(catalog.size());
+        for (const CatalogEntry& entry : catalog) {
+            put_string(entry.name);
+            put_u32(entry.columns.size());
+            for (const string& column : entry.columns) {
+                put_string(column);
+            }
+        }
+        string temp_path = catalog_path(config_file) + ".tmp";
+        int fd = ::open(temp_path.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+        if (fd < 0) {
+            return;
+        }
+        bool written = write(fd, data.data(), data.size()) == (ssize_t)data.size();
+        close(fd);
+        if (written) {
+            rename(temp_path.c_str(), catalog_path(config_file).c_str());
+        } else {
+            unlink(temp_path.c_str());
+        }
+    }
+
+    void insINTO(const string& table_name, const vector<string>& values) {
+        Table* table = find_table(table_name);
+        if (table) {
+            if (!table->insRow(values)) {
+                cerr << "Ошибка: строка не вставлена в таблицу " << table_name << endl;
+            }
+            checkpoint_if_needed();
+        } else {
+            cerr << "Таблица не найдена: " << table_name << endl;
+        }
+    }
+
+    // Программная пакетная вставка; возвращает число вставленных строк
+    int insertBatch(const string& table_name, const vector<vector<string>>& rows) {
+        Table* table = find_table(table_name);
+        if (!table) {
+            cerr << "Таблица не найдена: " << table_name << endl;
+            return 0;
+        }
+        int inserted = table->insBatch(rows);
+        checkpoint_if_needed();
+        return inserted;
+    }
+
+    // Накопительная статистика по таблицам с момента открытия схемы (SHOW STATS и STATS сервера)
+    void printTableStats(ostream& out) {
+        SegmentCache::instance().print_stats(out);
+        for (CatalogEntry& entry : catalog) {
+            Table* table = entry.table.load(memory_order_acquire);
+            if (!table) {
+                continue;  // Не открывалась
+            }
+            const ExecCounters& c = table->counters;
+            out << "Таблица " << table->table_name << ": запросов " << c.queries << ", сегментов открыто " << c.segments
+                << " (из кэша " << c.cached << ", пропущено по карте зон " << c.pruned << "), прочитано байт " << c.bytes << ", строк просмотрено " << c.rows
+                << ", проверок условия " << c.evaluations
+                << ", подходящих строк " << c.matched << ", ожидание блокировок " << table->table_lock.wait_ns / 1e6 << " мс" << endl;
+        }
+    }
+
+    // Строки COPY не журналируются: после загрузки файлы схемы сразу сбрасываются на диск
+    void copyFROM(const string& table_name, const string& file_path, bool header, ostream& out) {
+        Table* table = find_table(table_name);
+        if (table && table->copy_from(file_path, header, out) > 0) {
+            if (wal.fd >= 0) {
+                wal.checkpoint(schema_name, true);
+            } else {
+                int dir_fd = ::open(schema_name.c_str(), O_RDONLY | O_DIRECTORY);
+                if (dir_fd >= 0) {
+                    syncfs(dir_fd);
+                    close(dir_fd);
+                }
+            }
+        }
+    }
+
+    void createIndex(const string& table_name, const string& column, bool ordered, ostream& out) {
+        Table* table = find_table(table_name);
+        if (table) {
+            table->create_index(column, ordered, out);
+        }
+    }
+
+    void alterStorage(const string& table_name, bool columnar, ostream& out) {
+        Table* table = find_table(table_name);
+        if (table) {
+            table->set_storage(columnar, out);
+        }
+    }
+
+    // Запросы ниже получают таблицы и условие из плана, построенного SQLParser
+    void delFROM(Table* table, const WherePredicate& predicate, const string& condition, ostream& out) {
+        table->delRow(predicate, condition, out);
+        checkpoint_if_needed();
+    }
+
+    void aggregateFROM(Table* table, const vector<string>& items, const vector<string>& group_by, const WherePredicate& predicate, ResultSink& sink) {
+        table->aggregateRows(items, group_by, predicate, sink);
+    }
+
+    void selectFROM(Table* table, const string columns[], int col_count, const WherePredicate& predicate, ResultSink& sink,
+                    const SortSpec& sort_spec = SortSpec()) {
+        table->selectRows(columns, col_count, predicate, sink, sort_spec);
+    }
+
+    // predicate скомпилирован с разрешением колонок через resolve_join_column
+    void selFROMmult(Table* table1, Table* table2, const string columns[], int col_count, const WherePredicate& predicate, ResultSink& sink) {
+        Table* slot_tables[2] = {table1, table2};
+        auto resolve = [&](const string& column_name) {
+            return resolve_join_column(slot_tables, column_name);
+        };
+
+        vector<ColumnRef> projection;
+        for (int i = 0; i < col_count; ++i) {
+            projection.push_back(resolve(columns[i]));
+            if (projection.back().index == -1) {
+                cerr << "Столбец не найден " << columns[i] << endl;
+                return;
+            }
+        }
+        sink.begin("Вывод выбранных колонок из объединенных таблиц:", columns, col_count);
+        RowEncoder encoder = sink.encoder();
+
+        // Для условия из одних AND выделяем ключ соединения a.x = b.y и фильтры отдельных таблиц,
+        // которые применяются до соединения; остальное проверяется на соединенной паре строк
+        int join_col[2] = {-1, -1};
+        WherePredicate side_filter[2];
+        WherePredicate residual = predicate;
+        if (predicate.any_of.size() == 1) {
+            vector<WhereCond> side_conds[2];
+            vector<WhereCond> rest;
+            for (const WhereCond& cond : predicate.any_of[0]) {
+                bool cross = cond.rhs_slot >= 0 && cond.rhs_slot != cond.slot;
+                if (cross && cond.op == OP_EQ && join_col[0] == -1) {
+                    join_col[cond.slot] = cond.col_index;
+                    join_col[cond.rhs_slot] = cond.rhs_index;
+                } else if (cross) {
+                    rest.push_back(cond);
+                } else {
+                    side_conds[cond.slot].push_back(cond);
+                }
+            }
+            for (int slot = 0; slot < 2; ++slot) {
+                if (!side_conds[slot].empty()) {
+                    side_filter[slot].any_of.push_back(side_conds[slot]);
+                }
+            }
+            residual.any_of.clear();
+            if (!rest.empty()) {
+                residual.any_of.push_back(rest);
+            }
+        }
+
+        // Разделяемые блокировки берутся в порядке адресов таблиц, чтобы два запроса не ждали друг друга по кругу
+        Table* first_lock = min(table1, table2);
+        Table* second_lock = max(table1, table2);
+        first_lock->table_lock.sharedLock();
+        if (second_lock != first_lock) {
+            second_lock->table_lock.sharedLock();
+        }
+
+        // Хеш-таблица строится по меньшей таблице, большая потоково проходит через нее
+        int build = table2->row_count() <= table1->row_count() ? 1 : 0;
+        int probe = 1 - build;
+        Table* build_table = slot_tables[build];
+        Table* probe_table = slot_tables[probe];
+
+        // Строки стороны построения, прошедшие свои фильтры, копируются в буферы по сегментам
+        vector<string> build_data(build_table->segment_rows.size());
+        vector<vector<pair<size_t, size_t>>> build_lines(build_table->segment_rows.size());
+        vector<int> build_segments = build_table->zone_candidates(side_filter[build], build);
+        build_table->scan_rows([&](int segment, const RowFields& fields) {
+            const RowFields* rows[2] = {&fields, &fields};
+            if (side_filter[build].matches(rows)) {
+                build_lines[segment].push_back({build_data[segment].size(), fields.line_len});
+                build_data[segment].append(fields.line, fields.line_len);
+            }
+        }, &build_segments);
+
+        vector<RowFields> build_rows;
+        for (size_t segment = 0; segment < build_lines.size(); ++segment) {
+            for (const pair<size_t, size_t>& line : build_lines[segment]) {
+                build_rows.emplace_back();
+                build_rows.back().split(build_data[segment].data() + line.first, line.second);
+            }
+        }
+
+        unordered_map<string, vector<int>> hash_table;
+        vector<int> all_rows;  // Без ключа соединения каждая строка сочетается со всеми строками стороны построения
+        string key;
+        for (size_t i = 0; i < build_rows.size(); ++i) {
+            if (join_col[build] == -1) {
+                all_rows.push_back(i);
+            } else if (join_col[build] < (int)build_rows[i].fields.size()) {
+                WhereCond::cell_key(build_rows[i].fields[join_col[build]], key);
+                hash_table[key].push_back(i);
+            }
+        }
+
+        vector<string> results(probe_table->segment_rows.size());
+        vector<string> probe_keys(results.size());  // Буфер ключа на сегмент, чтобы не выделять память на строку
+        vector<int> probe_segments = probe_table->zone_candidates(side_filter[probe], probe);
+        probe_table->scan_rows([&](int segment, const RowFields& fields) {
+            const RowFields* rows[2];
+            rows[probe] = &fields;
+            rows[build] = &fields;
+            if (!side_filter[probe].matches(rows)) {
+                return;
+            }
+
+            const vector<int>* matches = &all_rows;
+            if (join_col[probe] != -1) {
+                if (join_col[probe] >= (int)fields.fields.size()) {
+                    return;
+                }
+                WhereCond::cell_key(fields.fields[join_col[probe]], probe_keys[segment]);
+                auto bucket = hash_table.find(probe_keys[segment]);
+                if (bucket == hash_table.end()) {
+                    return;
+                }
+                matches = &bucket->second;
+            }
+
+            for (int match : *matches) {
+                rows[build] = &build_rows[match];
+                if (residual.matches(rows)) {
+                    Table::printSelCol(rows, projection, encoder, results[segment]);
+                }
+            }
+        }, &probe_segments);
+
+        if (second_lock != first_lock) {
+            second_lock->table_lock.sharedUnlock();
+        }
+        first_lock->table_lock.sharedUnlock();
+
+        for (const string& result : results) {
+            sink.append(result);
+        }
+        sink.finish();
+    }
+};
+
+// Источник параметра плана: литерал из текста запроса или аргумент EXECUTE
+struct ParamSource {
+    int user_param;  // Номер аргумента EXECUTE; -1 — литерал
+    pmr::string literal;
+};
+
+// Подготовленный запрос: план и для каждого его параметра номер аргумента EXECUTE или литерал
+struct PreparedStatement {
+    shared_ptr<const QueryPlan> plan;
+    vector<int> user_params;  // -1 — значение из literals
+    vector<string> literals;
+    int arg_count = 0;
+};
+
+typedef map<string, PreparedStatement> PreparedStatements;
+
+// Состояние одного соединения (консоли, сессии --sessions, клиента сервера)
+struct SessionState {
+    PreparedStatements prepared;
+    ResultFormat format = ResultSink::default_format;  // SET FORMAT
+};
+
+struct SQLParser {
+    // Результаты запроса пишутся в out в формате сессии; сообщения об ошибках — в cerr.
+    // session — состояние соединения; nullptr — PREPARE, EXECUTE и SET недоступны
+    static void execQuery(const string& query, Database& db, ostream& out = cout, SessionState* session = nullptr) {
+        ResultSink sink(out, session ? session->format : ResultSink::default_format);
+        QueryArena arena;
+        SqlTokens tokens(&arena.resource);
+        if (!tokenize_sql(query, tokens)) {
+            return;
+        }
+        string command = tokens.empty() ? string() : string(tokens[0].text);
+
+        if (command == "INSERT" || command == "SELECT" || command == "DELETE") {
+            for (const SqlToken& token : tokens) {
+                if (token.kind == SqlToken::PARAM) {
+                    cerr << "Ошибка: параметры " << token.text << " допустимы только в PREPARE." << endl;
+                    return;
+                }
+            }
+            pmr::vector<ParamSource> sources(&arena.resource);
+            shared_ptr<const QueryPlan> plan = cached_plan(tokens, db, sources);
+            if (plan) {
+                pmr::vector<string_view> params(&arena.resource);
+                for (const ParamSource& source : sources) {
+                    params.push_back(source.literal);
+                }
+                execPlan(*plan, params, db, sink);
+            }
+        } else if (command == "PREPARE" || command == "EXECUTE" || command == "DEALLOCATE" || command == "SET") {
+            if (!session) {
+                cerr << "Ошибка: команда " << command << " недоступна в этом режиме." << endl;
+            } else if (command == "PREPARE") {
+                handlePrepare(tokens, db, session->prepared, sink.diag);
+            } else if (command == "EXECUTE") {
+                handleExecute(tokens, db, session->prepared, sink);
+            } else if (command == "DEALLOCATE") {
+                handleDeallocate(tokens, session->prepared, sink.diag);
+            } else {
+                handleSet(tokens, *session, out);
+            }
+        } else if (command == "CREATE") {
+            istringstream iss(query);
+            iss >> command;
+            handleCreateIndex(iss, db, sink.diag);
+        } else if (command == "ALTER") {
+            istringstream iss(query);
+            iss >> command;
+            handleAlter(iss, db, sink.diag);
+        } else if (command == "COPY") {
+            handleCopy(tokens, db, sink.diag);
+        } else if (command == "EXPLAIN") {
+            handleExplain(tokens, arena, db, out);
+        } else if (command == "SHOW") {
+            if (tokens.size() != 2 || tokens[1].text != "STATS") {
+                cerr << "Ошибка в синтаксисе SHOW: ожидалось SHOW STATS." << endl;
+            } else {
+                db.printTableStats(out);
+            }
         } else {
-            from_part = query.substr(from_pos + 5);
-            where_clause = "";
+            cerr << "Неизвестная SQL-команда: " << command << endl;
+        }
+    }
+
+private:
+    // Удаляет пробелы и двойные кавычки из значения: в ячейках и условиях они не учитываются
+    static void clean_value(pmr::string& value) {
+        value.erase(remove_if(value.begin(), value.end(), [](char c) { return c == ' ' || c == '"'; }), value.end());
+    }
+
+    // Литералы заменяются параметрами: ключ кэша — текст запроса с ? на месте литералов.
+    // Значения литералов (без пробелов и кавычек) и параметры PREPARE попадают в sources по порядку.
+    static string normalize(SqlTokens& tokens, pmr::vector<ParamSource>& sources) {
+        string key;
+        for (SqlToken& token : tokens) {
+            if (token.kind == SqlToken::NUMBER || token.kind == SqlToken::STRING || token.kind == SqlToken::PARAM) {
+                if (token.kind == SqlToken::PARAM) {
+                    sources.push_back({token.param, pmr::string(sources.get_allocator())});
+                } else {
+                    clean_value(token.text);
+                    sources.push_back({-1, move(token.text)});  // Строка остается в арене запроса
+                }
+                token.kind = SqlToken::PARAM;
+                token.text.assign(1, '?');
+                token.param = sources.size() - 1;
+            }
+            if (!key.empty()) {
+                key += ' ';
+            }
+            key += token.text;
+        }
+        return key;
+    }
+
+    // План из кэша или, при промахе, построенный и добавленный в кэш; nullptr при ошибке разбора
+    static shared_ptr<const QueryPlan> cached_plan(SqlTokens& tokens, Database& db, pmr::vector<ParamSource>& sources) {
+        string key = normalize(tokens, sources);
+        shared_ptr<const QueryPlan> plan = db.plans.find(key);
+        if (!plan) {
+            plan = buildPlan(tokens, db, sources.size());
+            if (plan) {
+                db.plans.insert(key, plan);
+            }
+        }
+        return plan;
+    }
+
+    // PREPARE имя AS запрос — параметры обозначаются ? или $1, $2, ...
+    static void handlePrepare(SqlTokens& tokens, Database& db, PreparedStatements& prepared, ostream& out) {
+        if (tokens.size() < 4 || tokens[1].kind != SqlToken::WORD || !tokens[2].is("AS") ||
+            !(tokens[3].is("SELECT") || tokens[3].is("INSERT") || tokens[3].is("DELETE"))) {
+            cerr << "Ошибка в синтаксисе PREPARE: ожидалось PREPARE <имя> AS SELECT | INSERT | DELETE ..." << endl;
+            return;
+        }
+        string name(tokens[1].text);
+        tokens.erase(tokens.begin(), tokens.begin() + 3);
+        pmr::vector<ParamSource> sources(tokens.get_allocator());
+        PreparedStatement statement;
+        statement.plan = cached_plan(tokens, db, sources);
+        if (!statement.plan) {
+            return;
+        }
+        for (const ParamSource& source : sources) {
+            statement.user_params.push_back(source.user_param);
+            statement.literals.emplace_back(source.literal);
+            statement.arg_count = max(statement.arg_count, source.user_param + 1);
+        }
+        prepared[name] = move(statement);
+        out << "Запрос " << name << " подготовлен, параметров: " << prepared[name].arg_count << endl;
+    }
+
+    // EXECUTE имя (значение, ...) — скобки необязательны
+    static void handleExecute(SqlTokens& tokens, Database& db, PreparedStatements& prepared, ResultSink& sink) {
+        auto it = tokens.size() < 2 ? prepared.end() : prepared.find(string(tokens[1].text));
+        if (it == prepared.end()) {
+            cerr << "Подготовленный запрос не найден: " << (tokens.size() < 2 ? "" : tokens[1].text) << endl;
+            return;
+        }
+        size_t begin = 2;
+        size_t end = tokens.size();
+        if (begin < end && tokens[begin].is_symbol("(")) {
+            if (!tokens[end - 1].is_symbol(")")) {
+                cerr << "Ошибка в синтаксисе EXECUTE: нет закрывающей скобки." << endl;
+                return;
+            }
+            begin++;
+            end--;
+        }
+        pmr::vector<string_view> args(tokens.get_allocator());
+        for (size_t i = begin; i < end; i += 2) {
+            SqlToken& value = tokens[i];
+            bool literal = value.kind == SqlToken::NUMBER || value.kind == SqlToken::STRING || value.kind == SqlToken::WORD;
+            if (!literal || (i + 1 < end && !tokens[i + 1].is_symbol(","))) {
+                cerr << "Ошибка в синтаксисе EXECUTE: ожидались значения через запятую." << endl;
+                return;
+            }
+            clean_value(value.text);
+            args.push_back(value.text);
+        }
+        const PreparedStatement& statement = it->second;
+        if ((int)args.size() != statement.arg_count) {
+            cerr << "Ошибка: запрос " << it->first << " ожидает параметров: " << statement.arg_count << ", передано: " << args.size() << endl;
+            return;
+        }
+        pmr::vector<string_view> params(tokens.get_allocator());
+        for (size_t i = 0; i < statement.user_params.size(); ++i) {
+            int user_param = statement.user_params[i];
+            params.push_back(user_param >= 0 ? args[user_param] : string_view(statement.literals[i]));
         }
+        execPlan(*statement.plan, params, db, sink);
+    }
 
-        space(select_part);
-        space(from_part);
-        space(where_clause);
+    // SET FORMAT TEXT | CSV | TSV | JSONL | BINARY — формат результатов до конца соединения
+    static void handleSet(const SqlTokens& tokens, SessionState& session, ostream& out) {
+        ResultFormat format;
+        if (tokens.size() != 3 || !tokens[1].is("FORMAT") || !parse_result_format(string(tokens[2].text), format)) {
+            cerr << "Ошибка в синтаксисе SET: ожидалось SET FORMAT TEXT | CSV | TSV | JSONL | BINARY." << endl;
+            return;
+        }
+        session.format = format;
+        (format == FORMAT_TEXT ? out : cerr) << "Формат вывода: " << tokens[2].text << endl;
+    }
 
-        string columns_str;
-        istringstream select_iss(select_part);
-        select_iss >> columns_str;
-        if (columns_str != "SELECT") {
-            cerr << "Ошибка: Ожидалось ключевое слово SELECT." << endl;
+    static void handleDeallocate(const SqlTokens& tokens, PreparedStatements& prepared, ostream& out) {
+        if (tokens.size() != 2 || !prepared.erase(string(tokens[1].text))) {
+            cerr << "Подготовленный запрос не найден: " << (tokens.size() < 2 ? "" : tokens[1].text) << endl;
             return;
         }
+        out << "Запрос " << tokens[1].text << " удален" << endl;
+    }
 
-        string column_names = select_part.substr(select_part.find("SELECT") + 7);
+    // Позиция первого ключевого слова из списка в [pos, end); end, если ни одного нет
+    static size_t find_keyword(const SqlTokens& tokens, size_t pos, size_t end, initializer_list<const char*> words) {
+        for (; pos < end; ++pos) {
+            for (const char* word : words) {
+                if (tokens[pos].is(word)) {
+                    return pos;
+                }
+            }
+        }
+        return end;
+    }
 
-        LinkedList parsed_columns;
-        // Проверка на символ '*', чтобы выбрать все колонки
-    if (column_names == "*") {
-    space(from_part); // Очистка лишних пробелов в from_part
-    string table_name = from_part; // Используем очищенную строку
+    // Список имен через запятую; false, если между запятыми не одно имя
+    static bool parse_names(const SqlTokens& tokens, size_t begin, size_t end, vector<string>& names) {
+        for (size_t i = begin; i < end; i += 2) {
+            if (tokens[i].kind != SqlToken::WORD || (i + 1 < end && !tokens[i + 1].is_symbol(","))) {
+                return false;
+            }
+            names.emplace_back(tokens[i].text);
+        }
+        return !names.empty();
+    }
 
-    Table* table = db.find_table(table_name);
-    if (!table) {
-        cerr << "Таблица не найдена: " << table_name << endl;
-        return;
+    // Строит план SELECT, INSERT или DELETE по нормализованным лексемам; nullptr при ошибке
+    static shared_ptr<QueryPlan> buildPlan(const SqlTokens& tokens, Database& db, int param_count) {
+        shared_ptr<QueryPlan> plan = make_shared<QueryPlan>();
+        plan->param_count = param_count;
+        bool ok;
+        if (tokens[0].is("INSERT")) {
+            ok = planInsert(tokens, db, *plan);
+        } else if (tokens[0].is("DELETE")) {
+            ok = planDelete(tokens, db, *plan);
+        } else {
+            ok = planSelect(tokens, db, *plan);
+        }
+        return ok ? plan : nullptr;
     }
 
-    // Добавляем все колонки таблицы в parsed_columns
-    for (int i = 0; i < table->columns_count; ++i) {
-        parsed_columns.push_back(table->columns[i]);
+    // INSERT INTO t VALUES (...), (...), ... — несколько кортежей вставляются одной пачкой
+    static bool planInsert(const SqlTokens& tokens, Database& db, QueryPlan& plan) {
+        plan.kind = PLAN_INSERT;
+        if (tokens.size() < 4 || !tokens[1].is("INTO") || tokens[2].kind != SqlToken::WORD || !tokens[3].is("VALUES")) {
+            cerr << "Ошибка в синтаксисе INSERT-запроса." << endl;
+            return false;
+        }
+        size_t pos = 4;
+        while (pos < tokens.size()) {
+            if (!tokens[pos].is_symbol("(")) {
+                break;
+            }
+            vector<SqlToken> row;
+            for (pos++; pos < tokens.size(); pos += 2) {
+                const SqlToken& value = tokens[pos];
+                if ((value.kind != SqlToken::PARAM && value.kind != SqlToken::WORD) || pos + 1 == tokens.size()) {
+                    break;
+                }
+                row.push_back(value);
+                if (tokens[pos + 1].is_symbol(")")) {
+                    break;
+                }
+                if (!tokens[pos + 1].is_symbol(",")) {
+                    break;
+                }
+            }
+            if (pos + 1 >= tokens.size() || !tokens[pos + 1].is_symbol(")")) {
+                break;
+            }
+            plan.rows.push_back(row);
+            pos += 2;
+            if (pos < tokens.size() && tokens[pos].is_symbol(",")) {
+                pos++;
+            } else {
+                break;
+            }
+        }
+        if (plan.rows.empty() || pos != tokens.size()) {
+            cerr << "Ошибка в синтаксисе INSERT-запроса." << endl;
+            return false;
+        }
+        plan.tables[0] = db.find_table(string(tokens[2].text));
+        return plan.tables[0] != nullptr;
     }
-    } else {
-        // Если '*' не используется, разбираем указанные колонки
-        parseCol(column_names, parsed_columns);
+
+    // DELETE FROM t [WHERE условие]
+    static bool planDelete(const SqlTokens& tokens, Database& db, QueryPlan& plan) {
+        plan.kind = PLAN_DELETE;
+        if (tokens.size() < 3 || !tokens[1].is("FROM") || tokens[2].kind != SqlToken::WORD ||
+            (tokens.size() > 3 && !tokens[3].is("WHERE"))) {
+            cerr << "Ошибка в синтаксисе DELETE-запроса." << endl;
+            return false;
+        }
+        plan.tables[0] = db.find_table(string(tokens[2].text));
+        if (!plan.tables[0]) {
+            return false;
+        }
+        if (tokens.size() > 3) {
+            plan.where = plan.tables[0]->compile_where(tokens, 4, tokens.size(), plan.where_params);
+            plan.where_tokens.assign(tokens.begin() + 4, tokens.end());
+        }
+        return plan.where.valid;
     }
 
-    istringstream from_iss(from_part);
-    string table_name;
-    LinkedList table_names;
+    // SELECT колонки | * | агрегаты FROM t[, t2] [WHERE ...] [GROUP BY ...] [ORDER BY col [ASC|DESC]] [LIMIT n]
+    static bool planSelect(const SqlTokens& tokens, Database& db, QueryPlan& plan) {
+        size_t end = tokens.size();
+        size_t from_pos = find_keyword(tokens, 1, end, {"FROM"});
+        if (from_pos == end) {
+            cerr << "Ошибка: Ключевое слово FROM не найдено в запросе." << endl;
+            return false;
+        }
+        size_t where_pos = find_keyword(tokens, from_pos, end, {"WHERE"});
+        size_t group_pos = find_keyword(tokens, from_pos, end, {"GROUP"});
+        size_t order_pos = find_keyword(tokens, from_pos, end, {"ORDER"});
+        size_t limit_pos = find_keyword(tokens, from_pos, end, {"LIMIT"});
+        // Каждое предложение продолжается до следующего ключевого слова
+        auto clause_end = [&](size_t pos) {
+            return find_keyword(tokens, pos + 1, end, {"WHERE", "GROUP", "ORDER", "LIMIT"});
+        };
+
+        // Список SELECT: имена, * или функции вида SUM(t.price) и COUNT(*)
+        vector<string> items;
+        bool has_function = false;
+        bool star = from_pos == 2 && tokens[1].is_symbol("*");
+        for (size_t i = 1; i < from_pos && !star; ++i) {
+            if (tokens[i].kind != SqlToken::WORD) {
+                cerr << "Ошибка в синтаксисе SELECT-запроса рядом с '" << tokens[i].text << "'." << endl;
+                return false;
+            }
+            string item(tokens[i].text);
+            if (i + 3 < from_pos && tokens[i + 1].is_symbol("(") && tokens[i + 3].is_symbol(")") &&
+                (tokens[i + 2].kind == SqlToken::WORD || tokens[i + 2].is_symbol("*"))) {
+                item += "(" + tokens[i + 2].text + ")";
+                has_function = true;
+                i += 3;
+            }
+            items.push_back(item);
+            if (i + 1 < from_pos && !tokens[++i].is_symbol(",")) {
+                cerr << "Ошибка в синтаксисе SELECT-запроса рядом с '" << tokens[i].text << "'." << endl;
+                return false;
+            }
+        }
+        if (!star && items.empty()) {
+            cerr << "Ошибка: Не указаны выводимые колонки." << endl;
+            return false;
+        }
 
-    while (getline(from_iss, table_name, ',')) {
-        space(table_name);
-        table_names.push_back(table_name);
-    }
+        vector<string> table_names;
+        if (!parse_names(tokens, from_pos + 1, clause_end(from_pos), table_names)) {
+            cerr << "Ошибка в синтаксисе FROM." << endl;
+            return false;
+        }
+        if (table_names.size() > 2) {
+            cerr << "Ошибка: Запрос может поддерживать только одну или две таблицы." << endl;
+            return false;
+        }
+        for (size_t i = 0; i < table_names.size(); ++i) {
+            plan.tables[i] = db.find_table(table_names[i]);
+            if (!plan.tables[i]) {
+                return false;
+            }
+        }
 
-    LinkedList tables;
-    for (int i = 0; i < table_names.size; ++i) {
-        Table* table = db.find_table(table_names.get(i));
-        if (table) {
-            tables.push_back(table->table_name);
+        if (group_pos != end) {
+            if (group_pos + 1 == end || !tokens[group_pos + 1].is("BY") ||
+                !parse_names(tokens, group_pos + 2, clause_end(group_pos), plan.group_by)) {
+                cerr << "Ошибка в синтаксисе GROUP BY." << endl;
+                return false;
+            }
+        }
+        if (order_pos != end) {
+            size_t order_end = clause_end(order_pos);
+            size_t count = order_end - order_pos;
+            if (count < 3 || count > 4 || !tokens[order_pos + 1].is("BY") || tokens[order_pos + 2].kind != SqlToken::WORD ||
+                (count == 4 && !tokens[order_pos + 3].is("ASC") && !tokens[order_pos + 3].is("DESC"))) {
+                cerr << "Ошибка в синтаксисе ORDER BY: ожидалось ORDER BY <колонка> [ASC|DESC]." << endl;
+                return false;
+            }
+            plan.sort.column = tokens[order_pos + 2].text;
+            plan.sort.descending = count == 4 && tokens[order_pos + 3].is("DESC");
+        }
+        if (limit_pos != end) {
+            if (clause_end(limit_pos) != limit_pos + 2 || tokens[limit_pos + 1].kind != SqlToken::PARAM) {
+                cerr << "Ошибка в синтаксисе LIMIT: ожидалось неотрицательное число." << endl;
+                return false;
+            }
+            plan.limit_param = tokens[limit_pos + 1].param;
+        }
+
+        if (has_function || group_pos != end) {
+            plan.kind = PLAN_AGGREGATE;
+            if (star || table_names.size() != 1) {
+                cerr << "Ошибка: Агрегаты и GROUP BY поддерживаются только для одной таблицы." << endl;
+                return false;
+            }
+            if (order_pos != end || limit_pos != end) {
+                cerr << "Ошибка: ORDER BY и LIMIT не поддерживаются вместе с агрегатами." << endl;
+                return false;
+            }
+        } else if (table_names.size() == 2) {
+            plan.kind = PLAN_JOIN;
+            if (order_pos != end || limit_pos != end) {
+                cerr << "Ошибка: ORDER BY и LIMIT поддерживаются только для выборки из одной таблицы." << endl;
+                return false;
+            }
         } else {
-            cerr << "Таблица не найдена: " << table_names.get(i) << endl;
-            return;
+            plan.kind = PLAN_SELECT;
+        }
+
+        // SELECT * — все колонки первой таблицы
+        if (star) {
+            items = plan.tables[0]->columns;
+        }
+        plan.columns = items;
+
+        if (where_pos != end) {
+            size_t where_end = clause_end(where_pos);
+            if (plan.kind == PLAN_JOIN) {
+                Table* const* tables = plan.tables;
+                plan.where = WherePredicate::compile(tokens, where_pos + 1, where_end, [tables](const string& column_name) {
+                    return resolve_join_column(tables, column_name);
+                }, plan.where_params);
+            } else {
+                plan.where = plan.tables[0]->compile_where(tokens, where_pos + 1, where_end, plan.where_params);
+            }
         }
+        return plan.where.valid;
     }
 
-    if (table_names.size == 1) {
-        // Создаем массив строк из LinkedList
-        string* columns_array = new string[parsed_columns.size];
-        for (int i = 0; i < parsed_columns.size; ++i) {
-            columns_array[i] = parsed_columns.get(i);
+    // Выполняет план с подставленными значениями параметров
+    static void execPlan(const QueryPlan& plan, const pmr::vector<string_view>& params, Database& db, ResultSink& sink) {
+        ostream& out = sink.diag;  // DELETE и INSERT печатают только служебные сообщения
+        WherePredicate where = plan.where.bind(plan.where_params, params);
+        for (Table* table : plan.tables) {
+            if (table) {
+                table->counters.queries++;
+            }
         }
+        switch (plan.kind) {
+            case PLAN_SELECT: {
+                SortSpec sort_spec = plan.sort;
+                if (plan.limit_param >= 0) {
+                    string_view limit = params[plan.limit_param];
+                    from_chars_result parsed = from_chars(limit.data(), limit.data() + limit.size(), sort_spec.limit);
+                    if (limit.empty() || parsed.ec != errc() || parsed.ptr != limit.data() + limit.size() || sort_spec.limit < 0) {
+                        cerr << "Ошибка в синтаксисе LIMIT: ожидалось неотрицательное число." << endl;
+                        return;
+                    }
+                }
+                db.selectFROM(plan.tables[0], plan.columns.data(), plan.columns.size(), where, sink, sort_spec);
+                break;
+            }
+            case PLAN_JOIN:
+                db.selFROMmult(plan.tables[0], plan.tables[1], plan.columns.data(), plan.columns.size(), where, sink);
+                break;
+            case PLAN_AGGREGATE:
+                db.aggregateFROM(plan.tables[0], plan.columns, plan.group_by, where, sink);
+                break;
+            case PLAN_DELETE: {
+                string condition;
+                for (const SqlToken& token : plan.where_tokens) {
+                    string text(token.text);
+                    if (token.kind == SqlToken::PARAM) {
+                        string value(params[token.param]);
+                        text = value.find_first_not_of("0123456789.-+") == string::npos ? value : "'" + value + "'";
+                    }
+                    condition += (condition.empty() ? "" : " ") + text;
+                }
+                db.delFROM(plan.tables[0], where, condition, out);  // Удаляем строки, соответствующие условию
+                out << "Команда DELETE выполнена успешно" << endl;
+                break;
+            }
+            case PLAN_INSERT: {
+                vector<vector<string>> rows(plan.rows.size());
+                for (size_t r = 0; r < plan.rows.size(); ++r) {
+                    rows[r].reserve(plan.rows[r].size());
+                    for (const SqlToken& value : plan.rows[r]) {
+                        string_view cell = value.kind == SqlToken::PARAM ? params[value.param] : string_view(value.text);
+                        if (cell.find_first_of(",\n") != string_view::npos) {
+                            cerr << "Ошибка: значение не может содержать запятую или перевод строки: " << cell << endl;
+                            return;
+                        }
+                        rows[r].emplace_back(cell);
+                    }
+                }
 
-        db.selectFROM(tables.get(0), columns_array, parsed_columns.size, where_clause);
+                auto started = chrono::steady_clock::now();
+                int inserted = db.insertBatch(plan.tables[0]->table_name, rows);
+                double seconds = chrono::duration<double>(chrono::steady_clock::now() - started).count();
+
+                if (inserted < (int)rows.size()) {
+                    cerr << "Ошибка: вставлено строк " << inserted << " из " << rows.size() << endl;
+                    break;
+                }
+                out << "Команда INSERT выполнена успешно" << endl;
+                if (inserted > 1) {
+                    out << "Вставлено строк: " << inserted << " за " << seconds * 1000 << " мс ("
+                         << (long long)(inserted / max(seconds, 1e-9)) << " строк/с)" << endl;
+                }
+                break;
+            }
+        }
+    }
 
-        delete[] columns_array; // Освобождаем память
-    } else if (table_names.size == 2) {
-        // Создаем массив строк из LinkedList
-        string* columns_array = new string[parsed_columns.size];
-        for (int i = 0; i < parsed_columns.size; ++i) {
-            columns_array[i] = parsed_columns.get(i);
+    // CREATE INDEX [имя] ON table (column) [USING HASH|ORDERED]
+    static void handleCreateIndex(istringstream& iss, Database& db, ostream& out) {
+        string index_kw, word;
+        iss >> index_kw >> word;
+        if (word != "ON") {
+            iss >> word;  // Имя индекса не используется: индекс определяется таблицей и колонкой
         }
+        string rest;
+        getline(iss, rest);
 
-        db.selFROMmult(tables.get(0), tables.get(1), columns_array, parsed_columns.size, where_clause);
+        size_t open = rest.find('(');
+        size_t close = rest.find(')');
+        if (index_kw != "INDEX" || word != "ON" || open == string::npos || close == string::npos || close < open) {
+            cerr << "Ошибка в синтаксисе CREATE INDEX." << endl;
+            return;
+        }
 
-        delete[] columns_array; // Освобождаем память
-    } else {
-        cerr << "Ошибка: Запрос может поддерживать только одну или две таблицы." << endl;
+        string table_name = rest.substr(0, open);
+        string column = rest.substr(open + 1, close - open - 1);
+        string using_part = rest.substr(close + 1);
+        space(table_name);
+        space(column);
+        space(using_part);
+
+        bool ordered = false;
+        if (using_part == "USING ORDERED") {
+            ordered = true;
+        } else if (!using_part.empty() && using_part != "USING HASH") {
+            cerr << "Ошибка в синтаксисе CREATE INDEX: ожидалось USING HASH или USING ORDERED." << endl;
+            return;
+        }
+
+        db.createIndex(table_name, column, ordered, out);
+    }
+
+    // ALTER TABLE t SET STORAGE COLUMNAR | CSV
+    static void handleAlter(istringstream& iss, Database& db, ostream& out) {
+        string table_kw, table_name, set_kw, storage_kw, mode, extra;
+        iss >> table_kw >> table_name >> set_kw >> storage_kw >> mode;
+        if (table_kw != "TABLE" || set_kw != "SET" || storage_kw != "STORAGE" || (mode != "COLUMNAR" && mode != "CSV") ||
+            (iss >> extra)) {
+            cerr << "Ошибка в синтаксисе ALTER TABLE: ожидалось ALTER TABLE <таблица> SET STORAGE COLUMNAR | CSV." << endl;
+            return;
+        }
+        db.alterStorage(table_name, mode == "COLUMNAR", out);
+    }
+
+    // EXPLAIN ANALYZE <SELECT | INSERT | DELETE>: запрос выполняется по-настоящему, строки результата отбрасываются,
+    // печатаются время по стадиям и счетчики сканирования, собранные со всех потоков запроса
+    static void handleExplain(SqlTokens& tokens, QueryArena& arena, Database& db, ostream& out) {
+        if (tokens.size() < 3 || tokens[1].text != "ANALYZE" ||
+            (tokens[2].text != "SELECT" && tokens[2].text != "INSERT" && tokens[2].text != "DELETE")) {
+            cerr << "Ошибка в синтаксисе EXPLAIN: ожидалось EXPLAIN ANALYZE SELECT | INSERT | DELETE ..." << endl;
+            return;
+        }
+        tokens.erase(tokens.begin(), tokens.begin() + 2);
+        for (const SqlToken& token : tokens) {
+            if (token.kind == SqlToken::PARAM) {
+                cerr << "Ошибка: параметры " << token.text << " допустимы только в PREPARE." << endl;
+                return;
+            }
+        }
+
+        ExecCounters counters;
+        ExecCounters* saved = query_counters;
+        query_counters = &counters;
+        auto started = chrono::steady_clock::now();
+        pmr::vector<ParamSource> sources(&arena.resource);
+        shared_ptr<const QueryPlan> plan = cached_plan(tokens, db, sources);
+        double parse_seconds = chrono::duration<double>(chrono::steady_clock::now() - started).count();
+        if (!plan) {
+            query_counters = saved;
+            return;
+        }
+        pmr::vector<string_view> params(&arena.resource);
+        for (const ParamSource& source : sources) {
+            params.push_back(source.literal);
+        }
+
+        DiscardStreambuf discard;
+        ostream discarded(&discard);
+        ResultSink sink(discarded);
+        started = chrono::steady_clock::now();
+        execPlan(*plan, params, db, sink);
+        double exec_seconds = chrono::duration<double>(chrono::steady_clock::now() - started).count();
+        query_counters = saved;
+
+        static const char* const kinds[] = {"SELECT", "JOIN", "AGGREGATE", "DELETE", "INSERT"};
+        out << "EXPLAIN ANALYZE: " << kinds[plan->kind] << " по таблице " << plan->tables[0]->table_name;
+        if (plan->tables[1]) {
+            out << " и " << plan->tables[1]->table_name;
+        }
+        out << endl;
+        out << "Время, мс: разбор " << parse_seconds * 1000 << ", выполнение " << (exec_seconds - sink.write_seconds) * 1000
+            << ", вывод " << sink.write_seconds * 1000 << " (байт результата: " << sink.bytes_written << ")" << endl;
+        out << "Сегментов открыто: " << counters.segments << " (из кэша: " << counters.cached << "), пропущено по карте зон: "
+            << counters.pruned << ", прочитано байт: " << counters.bytes << endl;
+        out << "Строк просмотрено: " << counters.rows << ", проверок условия: " << counters.evaluations
+            << ", подходящих строк: " << counters.matched << endl;
+        out << "Ожидание блокировок, мс: " << counters.lock_wait_ns / 1e6 << endl;
     }
-}
 
-    static void parseCol(const string& columns_str, LinkedList& parsed_columns) {
-        stringstream ss(columns_str);
-        string column;
-        while (getline(ss, column, ',')) {
-            space(column);
-            parsed_columns.push_back(column);
+    // COPY <таблица> FROM 'файл.csv' [HEADER]
+    static void handleCopy(const SqlTokens& tokens, Database& db, ostream& out) {
+        bool header = tokens.size() == 5 && tokens[4].kind == SqlToken::WORD && tokens[4].text == "HEADER";
+        if ((tokens.size() != 4 && !header) || tokens[1].kind != SqlToken::WORD || tokens[2].text != "FROM" ||
+            tokens[3].kind != SqlToken::STRING) {
+            cerr << "Ошибка в синтаксисе COPY: ожидалось COPY <таблица> FROM '<файл>' [HEADER]." << endl;
+            return;
         }
+        db.copyFROM(string(tokens[1].text), string(tokens[3].text), header, out);
     }
 
     static void space(string& str) {
@@ -778,20 +6358,604 @@ private:
     }
 };
 
-int main() {
+// Сессия параллельного режима: запросы из своего файла выполняются по очереди,
+// вывод каждого запроса печатается целиком под общим мьютексом
+struct Session {
+    Database* db;
+    string script_path;
+    int id;
+
+    static pthread_mutex_t output_lock;
+
+    static void* run(void* arg) {
+        Session* session = static_cast<Session*>(arg);
+        ifstream script(session->script_path);
+        if (!script) {
+            cerr << "Не удалось открыть файл сессии: " << session->script_path << endl;
+            return nullptr;
+        }
+
+        SessionState state;
+        string query;
+        while (getline(script, query)) {
+            if (query.find_first_not_of(' ') == string::npos) {
+                continue;
+            }
+            ostringstream out;
+            SQLParser::execQuery(query, *session->db, out, &state);
+
+            pthread_mutex_lock(&output_lock);
+            cout << "[сессия " << session->id << "] " << query << "\n" << out.str();
+            cout.flush();
+            pthread_mutex_unlock(&output_lock);
+        }
+        return nullptr;
+    }
+};
+
+pthread_mutex_t Session::output_lock = PTHREAD_MUTEX_INITIALIZER;
+
+// Буфер потока вывода поверх сокета: результат уходит клиенту порциями по мере заполнения, а не целиком в конце
+class SocketStreambuf : public streambuf {
+    int fd;
+    char buffer[64 * 1024];
+
+    bool send_all(const char* data, size_t size) {
+        while (size > 0) {
+            ssize_t written = send(fd, data, size, MSG_NOSIGNAL);
+            if (written < 0 && errno == EINTR) {
+                continue;
+            }
+            if (written <= 0) {
+                return false;  // Клиент отключился — остаток ответа отбрасывается
+            }
+            data += written;
+            size -= written;
+        }
+        return true;
+    }
+
+protected:
+    int overflow(int ch) override {
+        if (sync() != 0) {
+            return traits_type::eof();
+        }
+        if (ch != traits_type::eof()) {
+            *pptr() = (char)ch;
+            pbump(1);
+        }
+        return ch == traits_type::eof() ? 0 : ch;
+    }
+
+    int sync() override {
+        bool sent = send_all(pbase(), pptr() - pbase());
+        setp(buffer, buffer + sizeof(buffer));
+        return sent ? 0 : -1;
+    }
+
+public:
+    explicit SocketStreambuf(int socket_fd) : fd(socket_fd) {
+        setp(buffer, buffer + sizeof(buffer));
+    }
+};
+
+// Сервер запросов: epoll принимает соединения и читает запросы, фиксированный пул потоков их выполняет.
+// Протокол строковый: клиент шлет запрос одной строкой, сервер отвечает выводом запроса и строкой END.
+struct QueryServer {
+    struct Connection {
+        int fd = -1;
+        string input;  // Прочитанные, но еще не выполненные данные
+        bool busy = false;  // Соединение обслуживается рабочим потоком
+        bool closed = false;  // Клиент отключился
+        SessionState state;  // PREPARE и SET FORMAT действуют до конца соединения
+    };
+
+    Database& db;
+    int listen_fd = -1;
+    int epoll_fd = -1;
+    vector<pthread_t> workers;
+
+    pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;  // Защищает очередь и состояние соединений
+    pthread_cond_t wake = PTHREAD_COND_INITIALIZER;
+    deque<Connection*> ready;  // Соединения с полной строкой запроса
+
+    // Статистика для команды STATS
+    chrono::steady_clock::time_point started = chrono::steady_clock::now();
+    long long query_count = 0;
+    vector<double> latencies;  // Кольцевой буфер задержек последних запросов, мс
+    static const size_t LATENCY_WINDOW = 10000;
+
+    explicit QueryServer(Database& database) : db(database) {}
+
+    // address: "host:port" или ":port" для TCP, иначе путь Unix-сокета
+    bool listen_on(const string& address) {
+        size_t colon = address.rfind(':');
+        if (colon != string::npos) {
+            string host = address.substr(0, colon);
+            sockaddr_in addr{};
+            addr.sin_family = AF_INET;
+            addr.sin_port = htons((uint16_t)atoi(address.c_str() + colon + 1));
+            if (inet_pton(AF_INET, host.empty() ? "127.0.0.1" : host.c_str(), &addr.sin_addr) != 1) {
+                cerr << "Неверный адрес: " << address << endl;
+                return false;
+            }
+            listen_fd = socket(AF_INET, SOCK_STREAM, 0);
+            int reuse = 1;
+            setsockopt(listen_fd, SOL_SOCKET, SO_REUSEADDR, &reuse, sizeof(reuse));
+            if (bind(listen_fd, (sockaddr*)&addr, sizeof(addr)) != 0) {
+                cerr << "Не удалось занять адрес " << address << ": " << strerror(errno) << endl;
+                return false;
+            }
+        } else {
+            sockaddr_un addr{};
+            addr.sun_family = AF_UNIX;
+            if (address.size() >= sizeof(addr.sun_path)) {
+                cerr << "Слишком длинный путь сокета: " << address << endl;
+                return false;
+            }
+            strcpy(addr.sun_path, address.c_str());
+            unlink(address.c_str());  // Сокет, оставшийся от прошлого запуска
+            listen_fd = socket(AF_UNIX, SOCK_STREAM, 0);
+            if (bind(listen_fd, (sockaddr*)&addr, sizeof(addr)) != 0) {
+                cerr << "Не удалось занять адрес " << address << ": " << strerror(errno) << endl;
+                return false;
+            }
+        }
+        return listen(listen_fd, SOMAXCONN) == 0;
+    }
+
+    void run(int worker_count) {
+        epoll_fd = epoll_create1(0);
+        epoll_event event{};
+        event.events = EPOLLIN;
+        event.data.ptr = nullptr;  // nullptr — слушающий сокет
+        epoll_ctl(epoll_fd, EPOLL_CTL_ADD, listen_fd, &event);
+
+        for (int i = 0; i < worker_count; ++i) {
+            pthread_t thread;
+            if (pthread_create(&thread, nullptr, worker, this) == 0) {
+                workers.push_back(thread);
+            }
+        }
+        cerr << "Сервер запущен, рабочих потоков: " << workers.size() << endl;
+
+        epoll_event events[64];
+        while (true) {
+            int count = epoll_wait(epoll_fd, events, 64, -1);
+            if (count < 0 && errno != EINTR) {
+                cerr << "Ошибка epoll: " << strerror(errno) << endl;
+                return;
+            }
+            for (int i = 0; i < count; ++i) {
+                Connection* conn = static_cast<Connection*>(events[i].data.ptr);
+                if (!conn) {
+                    accept_client();
+                } else {
+                    read_client(conn);
+                }
+            }
+        }
+    }
+
+private:
+    void accept_client() {
+        int fd = accept(listen_fd, nullptr, nullptr);
+        if (fd < 0) {
+            return;
+        }
+        Connection* conn = new Connection();
+        conn->fd = fd;
+        epoll_event event{};
+        event.events = EPOLLIN;
+        event.data.ptr = conn;
+        epoll_ctl(epoll_fd, EPOLL_CTL_ADD, fd, &event);
+    }
+
+    void read_client(Connection* conn) {
+        char buffer[64 * 1024];
+        ssize_t size = read(conn->fd, buffer, sizeof(buffer));
+        if (size < 0 && errno == EINTR) {
+            return;
+        }
+
+        pthread_mutex_lock(&lock);
+        if (size <= 0) {
+            epoll_ctl(epoll_fd, EPOLL_CTL_DEL, conn->fd, nullptr);
+            conn->closed = true;
+            if (!conn->busy) {
+                close(conn->fd);
+                delete conn;
+            }
+        } else {
+            conn->input.append(buffer, size);
+            // Запросы одного соединения выполняются строго по очереди: пока рабочий поток занят им, новый не назначается
+            if (!conn->busy && conn->input.find('\n') != string::npos) {
+                conn->busy = true;
+                ready.push_back(conn);
+                pthread_cond_signal(&wake);
+            }
+        }
+        pthread_mutex_unlock(&lock);
+    }
+
+    static void* worker(void* arg) {
+        static_cast<QueryServer*>(arg)->serve();
+        return nullptr;
+    }
+
+    void serve() {
+        pthread_mutex_lock(&lock);
+        while (true) {
+            while (ready.empty()) {
+                pthread_cond_wait(&wake, &lock);
+            }
+            Connection* conn = ready.front();
+            ready.pop_front();
+
+            size_t end;
+            while (!conn->closed && (end = conn->input.find('\n')) != string::npos) {
+                string query = conn->input.substr(0, end);
+                conn->input.erase(0, end + 1);
+                if (!query.empty() && query.back() == '\r') {
+                    query.pop_back();
+                }
+                pthread_mutex_unlock(&lock);
+                execute(conn, query);
+                pthread_mutex_lock(&lock);
+            }
+
+            conn->busy = false;
+            if (conn->closed) {
+                close(conn->fd);
+                delete conn;
+            }
+        }
+    }
+
+    void execute(Connection* conn, const string& query) {
+        SocketStreambuf buffer(conn->fd);
+        ostream out(&buffer);
+
+        if (query == "STATS") {
+            print_stats(out);
+        } else if (query.find_first_not_of(' ') != string::npos) {
+            auto start = chrono::steady_clock::now();
+            SQLParser::execQuery(query, db, out, &conn->state);
+            double elapsed_ms = chrono::duration<double, milli>(chrono::steady_clock::now() - start).count();
+
+            pthread_mutex_lock(&lock);
+            if (latencies.size() < LATENCY_WINDOW) {
+                latencies.push_back(elapsed_ms);
+            } else {
+                latencies[query_count % LATENCY_WINDOW] = elapsed_ms;
+            }
+            ++query_count;
+            pthread_mutex_unlock(&lock);
+        }
+        out << "END" << endl;
+    }
+
+    void print_stats(ostream& out) {
+        pthread_mutex_lock(&lock);
+        long long total = query_count;
+        vector<double> window = latencies;
+        pthread_mutex_unlock(&lock);
+
+        double seconds = chrono::duration<double>(chrono::steady_clock::now() - started).count();
+        out << "Запросов: " << total << ", QPS: " << (seconds > 0 ? total / seconds : 0) << endl;
+        pthread_mutex_lock(&db.plans.lock);
+        out << "Кэш планов: " << db.plans.entries.size() << " планов, попаданий " << db.plans.hits << ", промахов " << db.plans.misses << endl;
+        pthread_mutex_unlock(&db.plans.lock);
+        out << "Уплотнение: шагов " << db.compacted_steps << ", переписано байт " << db.compacted_bytes << endl;
+        db.printTableStats(out);
+        if (window.empty()) {
+            return;
+        }
+        sort(window.begin(), window.end());
+        auto percentile = [&window](double p) {
+            return window[min(window.size() - 1, (size_t)(p * window.size()))];
+        };
+        out << "Задержка по последним " << window.size() << " запросам, мс: p50 " << percentile(0.5)
+            << ", p95 " << percentile(0.95) << ", p99 " << percentile(0.99) << ", max " << window.back() << endl;
+    }
+};
+
+// Воспроизводимый замер производительности (--bench <каталог>): синтетическая схема из таблицы a ширины columns
+// и таблицы b для соединения, нагрузки идут через SQLParser::execQuery, как запросы пользователя.
+// Результат — по строке JSON на нагрузку в stdout: пропускная способность, p50/p99 задержки и пиковый RSS
+struct Benchmark {
+    string dir;  // Каталог замера; схема создается в нем заново
+    long long rows = 100000;  // --bench-rows: строк в таблице a (в b — десятая часть)
+    int columns = 4;  // --bench-columns: колонок в таблице a, не меньше 3
+    int tuples_limit = 10000;  // --bench-limit
+    int queries = 1000;  // --bench-queries: точечных SELECT; остальных нагрузок меньше
+    unsigned seed = 1;  // --bench-seed
+
+    mt19937 random;
+    ostringstream sink;  // Вывод запросов замеряется, но не печатается
+
+    long long next(long long bound) {
+        return random() % bound;
+    }
+
+    string config_path() const {
+        return dir + "/scheme.json";
+    }
+
+    void write_config() {
+        ofstream config(config_path());
+        config << "{\n    \"name\": \"" << dir << "/bench\",\n    \"tuples_limit\": " << tuples_limit << ",\n";
+        config << "    \"structure\": [\n        {\n            \"table_name\": \"a\",\n            \"columns\": [\n";
+        for (int i = 1; i <= columns; ++i) {
+            config << "                \"c" << i << "\"" << (i < columns ? "," : "") << "\n";
+        }
+        config << "            ]\n        },\n        {\n            \"table_name\": \"b\",\n            \"columns\": [\n";
+        config << "                \"k\",\n                \"v\"\n            ]\n        }\n    ]\n}\n";
+    }
+
+    // Выполняет запросы по одному, замеряя каждый; ops — число запросов, rows — обработанных строк
+    struct Result {
+        vector<double> latencies;  // мс
+        double seconds = 0;
+        long long rows = 0;
+    };
+
+    void run_query(Database& db, const string& query, Result& result) {
+        sink.str("");
+        auto start = chrono::steady_clock::now();
+        SQLParser::execQuery(query, db, sink);
+        double elapsed = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+        result.latencies.push_back(elapsed * 1000);
+        result.seconds += elapsed;
+    }
+
+    void report(const string& workload, Result& result) {
+        sort(result.latencies.begin(), result.latencies.end());
+        auto percentile = [&result](double p) {
+            return result.latencies.empty() ? 0.0 : result.latencies[min(result.latencies.size() - 1, (size_t)(p * result.latencies.size()))];
+        };
+        struct rusage usage;
+        getrusage(RUSAGE_SELF, &usage);
+        long long ops = result.latencies.size();
+        double seconds = max(result.seconds, 1e-9);
+        cout << "{\"workload\":\"" << workload << "\",\"ops\":" << ops << ",\"rows\":" << result.rows
+             << ",\"seconds\":" << result.seconds << ",\"ops_per_sec\":" << ops / seconds
+             << ",\"rows_per_sec\":" << result.rows / seconds << ",\"p50_ms\":" << percentile(0.5)
+             << ",\"p99_ms\":" << percentile(0.99) << ",\"peak_rss_kb\":" << usage.ru_maxrss << "}" << endl;
+    }
+
+    int run(FsyncPolicy fsync_policy, int fsync_interval_ms) {
+        struct stat st;
+        if (columns < 3 || rows < 10 || tuples_limit < 1 || queries < 1) {
+            cerr << "Неверные параметры замера: нужно --bench-columns >= 3, --bench-rows >= 10, --bench-limit >= 1, --bench-queries >= 1" << endl;
+            return 1;
+        }
+        if (stat(dir.c_str(), &st) == 0) {
+            cerr << "Каталог замера уже существует: " << dir << " (для воспроизводимости нужен новый)" << endl;
+            return 1;
+        }
+        if (mkdir(dir.c_str(), 0777) != 0) {
+            cerr << "Не удалось создать каталог замера " << dir << ": " << strerror(errno) << endl;
+            return 1;
+        }
+        write_config();
+        random.seed(seed);
+        cout << "{\"bench\":\"config\",\"rows\":" << rows << ",\"columns\":" << columns << ",\"tuples_limit\":" << tuples_limit
+             << ",\"queries\":" << queries << ",\"seed\":" << seed << "}" << endl;
+
+        Database db(config_path(), fsync_policy, fsync_interval_ms);
+        long long join_rows = rows / 10;
+        const int BATCH = 100;  // Строк в одном INSERT
+
+        Result insert;
+        for (long long done = 0; done < rows;) {
+            string query = "INSERT INTO a VALUES ";
+            for (int i = 0; i < BATCH && done < rows; ++i, ++done) {
+                query += i ? ",(" : "(";
+                query += "'s" + to_string(next(1000000)) + "'," + to_string(next(10000)) + "," + to_string(next(join_rows));
+                for (int c = 4; c <= columns; ++c) {
+                    query += "," + to_string(next(1000000));
+                }
+                query += ")";
+            }
+            run_query(db, query, insert);
+        }
+        for (long long done = 0; done < join_rows;) {
+            string query = "INSERT INTO b VALUES ";
+            for (int i = 0; i < BATCH && done < join_rows; ++i, ++done) {
+                query += (i ? ",(" : "(") + to_string(done) + "," + to_string(next(10000)) + ")";
+            }
+            run_query(db, query, insert);
+        }
+        insert.rows = rows + join_rows;
+        report("insert", insert);
+
+        Result point;
+        for (int i = 0; i < queries; ++i) {
+            run_query(db, "SELECT a.c1, a.c2 FROM a WHERE a.a_pk = " + to_string(1 + next(rows)), point);
+        }
+        point.rows = queries;
+        report("point_select", point);
+
+        Result range;  // Около 1% строк на запрос
+        for (int i = 0; i < max(1, queries / 10); ++i) {
+            long long low = next(9900);
+            run_query(db, "SELECT a.c1 FROM a WHERE a.c2 >= " + to_string(low) + " AND a.c2 < " + to_string(low + 100), range);
+        }
+        range.rows = rows * range.latencies.size();
+        report("range_select", range);
+
+        Result join;
+        for (int i = 0; i < max(1, queries / 100); ++i) {
+            run_query(db, "SELECT a.c1, b.v FROM a, b WHERE a.c3 = b.k AND b.v < " + to_string(1 + next(100)), join);
+        }
+        join.rows = (rows + join_rows) * join.latencies.size();
+        report("join", join);
+
+        Result remove;
+        for (int i = 0; i < max(1, queries / 100); ++i) {
+            run_query(db, "DELETE FROM a WHERE a.c2 = " + to_string(next(10000)), remove);
+        }
+        remove.rows = rows * remove.latencies.size();
+        report("delete", remove);
+        return 0;
+    }
+};
+
+// Клиент сервера: отправляет запросы из stdin и печатает ответы до строки END
+int run_client(const string& address) {
+    int fd;
+    size_t colon = address.rfind(':');
+    if (colon != string::npos) {
+        sockaddr_in addr{};
+        addr.sin_family = AF_INET;
+        addr.sin_port = htons((uint16_t)atoi(address.c_str() + colon + 1));
+        string host = address.substr(0, colon);
+        inet_pton(AF_INET, host.empty() ? "127.0.0.1" : host.c_str(), &addr.sin_addr);
+        fd = socket(AF_INET, SOCK_STREAM, 0);
+        if (connect(fd, (sockaddr*)&addr, sizeof(addr)) != 0) {
+            fd = -1;
+        }
+    } else {
+        sockaddr_un addr{};
+        addr.sun_family = AF_UNIX;
+        strncpy(addr.sun_path, address.c_str(), sizeof(addr.sun_path) - 1);
+        fd = socket(AF_UNIX, SOCK_STREAM, 0);
+        if (connect(fd, (sockaddr*)&addr, sizeof(addr)) != 0) {
+            fd = -1;
+        }
+    }
+    if (fd < 0) {
+        cerr << "Не удалось подключиться к " << address << ": " << strerror(errno) << endl;
+        return 1;
+    }
+
+    FILE* responses = fdopen(fd, "r");
+    string query;
+    char* line = nullptr;
+    size_t capacity = 0;
+    while (getline(cin, query) && query != "exit") {
+        query += '\n';
+        if (send(fd, query.data(), query.size(), MSG_NOSIGNAL) != (ssize_t)query.size()) {
+            break;
+        }
+        ssize_t length;
+        while ((length = getline(&line, &capacity, responses)) > 0 && strcmp(line, "END\n") != 0) {
+            cout.write(line, length);
+        }
+        if (length <= 0) {
+            break;
+        }
+        cout.flush();
+    }
+    free(line);
+    fclose(responses);
+    return 0;
+}
+
+int main(int argc, char* argv[]) {
+    string config_file = "/home/skywalker/Рабочий стол/output/scheme.json";
+    vector<string> session_scripts;  // --sessions: каждый файл выполняется в своем потоке
+    string listen_address;  // --listen: режим сервера
+    int server_workers = max(1L, sysconf(_SC_NPROCESSORS_ONLN));
+    FsyncPolicy fsync_policy = FSYNC_COMMIT;  // --fsync commit | os | <мс>
+    int fsync_interval_ms = 0;
+    Benchmark bench;  // --bench: замер вместо интерактивного режима
+
+    for (int i = 1; i < argc; ++i) {
+        string arg = argv[i];
+        if (arg == "--config" && i + 1 < argc) {
+            config_file = argv[++i];
+        } else if (arg == "--listen" && i + 1 < argc) {
+            listen_address = argv[++i];
+        } else if (arg == "--fsync" && i + 1 < argc) {
+            string policy = argv[++i];
+            if (policy == "commit") {
+                fsync_policy = FSYNC_COMMIT;
+            } else if (policy == "os") {
+                fsync_policy = FSYNC_OS;
+            } else if (atoi(policy.c_str()) > 0) {
+                fsync_policy = FSYNC_INTERVAL;
+                fsync_interval_ms = atoi(policy.c_str());
+            } else {
+                cerr << "Неверная политика --fsync: " << policy << " (commit, os или интервал в мс)" << endl;
+                return 1;
+            }
+        } else if (arg == "--format" && i + 1 < argc) {
+            if (!parse_result_format(argv[++i], ResultSink::default_format)) {
+                cerr << "Неизвестный формат вывода: " << argv[i] << " (text, csv, tsv, jsonl, binary)" << endl;
+                return 1;
+            }
+        } else if (arg == "--sort-memory" && i + 1 < argc) {
+            RowSorter::memory_budget = max(1LL, atoll(argv[++i])) << 20;  // Мегабайты
+        } else if (arg == "--cache-memory" && i + 1 < argc) {
+            SegmentCache::budget = max(0LL, atoll(argv[++i])) << 20;  // Мегабайты, 0 — без кэша сегментов
+        } else if (arg == "--compact-rate" && i + 1 < argc) {
+            Table::compact_rate = max(0LL, atoll(argv[++i])) << 20;  // Мегабайты в секунду, 0 — без уплотнения
+        } else if (arg == "--workers" && i + 1 < argc) {
+            server_workers = max(1, atoi(argv[++i]));
+        } else if (arg == "--connect" && i + 1 < argc) {
+            return run_client(argv[++i]);  // Клиенту схема не нужна
+        } else if (arg == "--bench" && i + 1 < argc) {
+            bench.dir = argv[++i];
+        } else if (arg == "--bench-rows" && i + 1 < argc) {
+            bench.rows = atoll(argv[++i]);
+        } else if (arg == "--bench-columns" && i + 1 < argc) {
+            bench.columns = atoi(argv[++i]);
+        } else if (arg == "--bench-limit" && i + 1 < argc) {
+            bench.tuples_limit = atoi(argv[++i]);
+        } else if (arg == "--bench-queries" && i + 1 < argc) {
+            bench.queries = atoi(argv[++i]);
+        } else if (arg == "--bench-seed" && i + 1 < argc) {
+            bench.seed = strtoul(argv[++i], nullptr, 10);
+        } else if (arg == "--sessions") {
+            while (i + 1 < argc && string(argv[i + 1]).compare(0, 2, "--") != 0) {
+                session_scripts.push_back(argv[++i]);
+            }
+        } else {
+            cerr << "Неизвестный аргумент: " << arg << endl;
+            return 1;
+        }
+    }
+
+    if (!bench.dir.empty()) {
+        return bench.run(fsync_policy, fsync_interval_ms);
+    }
 
-    Database db("/home/skywalker/Рабочий стол/output/scheme.json");
+    Database db(config_file, fsync_policy, fsync_interval_ms);
 
+    if (!listen_address.empty()) {
+        QueryServer server(db);
+        if (!server.listen_on(listen_address)) {
+            return 1;
+        }
+        server.run(server_workers);
+        return 1;
+    }
+
+    if (!session_scripts.empty()) {
+        vector<Session> sessions(session_scripts.size());
+        vector<pthread_t> threads(session_scripts.size());
+        for (size_t i = 0; i < sessions.size(); ++i) {
+            sessions[i] = Session{&db, session_scripts[i], (int)i + 1};
+            pthread_create(&threads[i], nullptr, Session::run, &sessions[i]);
+        }
+        for (pthread_t thread : threads) {
+            pthread_join(thread, nullptr);
+        }
+        return 0;
+    }
+
+    SessionState state;
     string user_query;
     while (true) {
-        cout << "Введите SQL-запрос (или 'exit' для выхода): ";
-        getline(cin, user_query);
-
-        if (user_query == "exit") {
+        // В табличных форматах stdout занят данными, приглашение уходит в stderr
+        (state.format == FORMAT_TEXT ? cout : cerr) << "Введите SQL-запрос (или 'exit' для выхода): ";
+        if (!getline(cin, user_query) || user_query == "exit") {
             break;
         }
 
-        SQLParser::execQuery(user_query, db);
+        SQLParser::execQuery(user_query, db, cout, &state);
     }
 
     return 0;